@@ -0,0 +1,215 @@
+/**
+ * Fast lossless compression of small blocks of binary data
+ */
+#ifndef YARF_BLOCKCODEC_HPP
+#define YARF_BLOCKCODEC_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "RFtypes.hpp"
+
+
+/**
+ * A byte oriented LZ77 compressor in the style of LZ4, together with a byte
+ * plane shuffle which groups the corresponding bytes of fixed size records
+ * so that slowly varying fields (such as the exponents of floating point
+ * values, or the high bytes of small integers) form long repeated runs.
+ *
+ * Compressed data is a sequence of
+ *   token: high nibble literal length, low nibble match length - MinMatch
+ *   [extra literal length bytes if the nibble is 15, each 255 continues]
+ *   literals
+ *   u16 little-endian match offset
+ *   [extra match length bytes if the nibble is 15, each 255 continues]
+ * The final sequence contains only literals. The uncompressed size isn't
+ * stored and must be known by the caller.
+ */
+class BlockCodec
+{
+public:
+    /**
+     * Compress a block
+     * src: The data
+     * n: Number of bytes
+     * out: String to which the compressed data is appended
+     */
+    static void compress(const char* src, size_t n, std::string& out) {
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+        std::vector<uint> table(HashSize, uint(-1));
+
+        size_t anchor = 0;
+        size_t i = 0;
+        while (n >= MinMatch && i + MinMatch <= n) {
+            uint h = hash(in + i);
+            uint candidate = table[h];
+            table[h] = i;
+
+            if (candidate == uint(-1) || i - candidate > MaxOffset ||
+                std::memcmp(in + candidate, in + i, MinMatch) != 0) {
+                ++i;
+                continue;
+            }
+
+            size_t len = MinMatch;
+            while (i + len < n && in[candidate + len] == in[i + len]) {
+                ++len;
+            }
+
+            sequence(out, in + anchor, i - anchor, i - candidate,
+                     len - MinMatch);
+            i += len;
+            anchor = i;
+        }
+
+        // Trailing literals, with a zero match length nibble
+        out += char(std::min<size_t>(n - anchor, 15) << 4);
+        length(out, n - anchor);
+        out.append(src + anchor, n - anchor);
+    }
+
+    /**
+     * Decompress a block, returns false if the data is invalid
+     * src: The compressed data
+     * n: Number of compressed bytes
+     * dst: Buffer to hold the uncompressed data
+     * size: Exact size of the uncompressed data
+     */
+    static bool decompress(const char* src, size_t n, char* dst,
+                           size_t size) {
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+        const unsigned char* end = in + n;
+        size_t pos = 0;
+
+        while (in < end) {
+            uint token = *in++;
+
+            size_t lits = token >> 4;
+            if (lits == 15 && !length(in, end, lits)) {
+                return false;
+            }
+            if (lits > size_t(end - in) || lits > size - pos) {
+                return false;
+            }
+            std::memcpy(dst + pos, in, lits);
+            in += lits;
+            pos += lits;
+
+            if (in == end) {
+                // Last sequence
+                return pos == size;
+            }
+
+            if (end - in < 2) {
+                return false;
+            }
+            size_t offset = in[0] | (in[1] << 8);
+            in += 2;
+
+            size_t len = token & 15;
+            if (len == 15 && !length(in, end, len)) {
+                return false;
+            }
+            len += MinMatch;
+            if (offset == 0 || offset > pos || len > size - pos) {
+                return false;
+            }
+
+            // May overlap, so copy a byte at a time
+            const char* from = dst + pos - offset;
+            for (size_t k = 0; k < len; ++k) {
+                dst[pos + k] = from[k];
+            }
+            pos += len;
+        }
+
+        return false;
+    }
+
+    /**
+     * Split an array of records into byte planes: byte b of every record,
+     * for each b in turn
+     * src: The records
+     * dst: Buffer for the shuffled data, the same size as src
+     * n: Number of records
+     * recordSize: Bytes per record
+     */
+    static void shuffle(const char* src, char* dst, size_t n,
+                        size_t recordSize) {
+        for (size_t b = 0; b < recordSize; ++b) {
+            for (size_t r = 0; r < n; ++r) {
+                *dst++ = src[r * recordSize + b];
+            }
+        }
+    }
+
+    /**
+     * Reverse shuffle()
+     */
+    static void unshuffle(const char* src, char* dst, size_t n,
+                          size_t recordSize) {
+        for (size_t b = 0; b < recordSize; ++b) {
+            for (size_t r = 0; r < n; ++r) {
+                dst[r * recordSize + b] = *src++;
+            }
+        }
+    }
+
+protected:
+    static const uint MinMatch = 4;
+    static const uint MaxOffset = 65535;
+    static const uint HashBits = 12;
+    static const uint HashSize = 1 << HashBits;
+
+    static uint hash(const unsigned char* p) {
+        uint x = p[0] | (p[1] << 8) | (p[2] << 16) | (uint(p[3]) << 24);
+        return (x * 2654435761u) >> (32 - HashBits);
+    }
+
+    /**
+     * Append a sequence of literals followed by a match
+     */
+    static void sequence(std::string& out, const unsigned char* lits,
+                         size_t nlits, size_t offset, size_t len) {
+        out += char((std::min<size_t>(nlits, 15) << 4) |
+                    std::min<size_t>(len, 15));
+        length(out, nlits);
+        out.append(reinterpret_cast<const char*>(lits), nlits);
+        out += char(offset & 0xff);
+        out += char(offset >> 8);
+        length(out, len);
+    }
+
+    /**
+     * Append the extra bytes of a length which didn't fit in a nibble
+     */
+    static void length(std::string& out, size_t len) {
+        if (len < 15) {
+            return;
+        }
+        for (len -= 15; len >= 255; len -= 255) {
+            out += char(255);
+        }
+        out += char(len);
+    }
+
+    /**
+     * Read the extra bytes of a length, returns false if the data ends
+     */
+    static bool length(const unsigned char*& in, const unsigned char* end,
+                       size_t& len) {
+        uint b;
+        do {
+            if (in == end) {
+                return false;
+            }
+            b = *in++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+};
+
+
+#endif // YARF_BLOCKCODEC_HPP
@@ -4,6 +4,9 @@
 #ifndef YARF_DATAIO_HPP
 #define YARF_DATAIO_HPP
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -11,6 +14,9 @@
 #include "refcountptr.hpp"
 #include "RFtypes.hpp"
 #include "Logger.hpp"
+#include "Dataset.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
 
 class Tokeniser
 {
@@ -281,4 +287,810 @@ private:
 };
 
 
+/**
+ * Receives the rows of a CSV file from MappedCsvReader::scan(). When parsing
+ * with several threads setRow() is called concurrently, but never twice for
+ * the same row.
+ */
+class CsvRowSink
+{
+public:
+    virtual ~CsvRowSink() {
+    }
+
+    /**
+     * Called once before any rows are stored
+     * rows: The number of rows in the file
+     * cols: The number of values in each row
+     */
+    virtual void resize(uint rows, uint cols) = 0;
+
+    /**
+     * Store a row
+     * r: The row index
+     * x: The cols values of the row
+     */
+    virtual void setRow(uint r, const double* x) = 0;
+};
+
+
+/**
+ * Read a numeric CSV file using a read only memory mapping, no escapes, no
+ * header. Has the same interface and checks as CsvReader, but the mapped
+ * file is scanned in place with memchr and numbers are parsed with strtod,
+ * and the values are stored in a single row-major array, so nothing is
+ * allocated per line or per token.
+ *
+ * The file can be parsed with several threads: it is split into chunks at
+ * line boundaries, the lines in each chunk are counted so that every row
+ * has a known index, then the chunks are parsed concurrently with each row
+ * written directly to its final position.
+ */
+class MappedCsvReader
+{
+public:
+    MappedCsvReader():
+        m_rows(0), m_cols(0) {
+    }
+
+    /**
+     * Parse a CSV file
+     * file: The CSV file name
+     * nthreads: The number of threads, 0 to use all processors
+     */
+    bool parse(const char file[], uint nthreads = 1) {
+        ValueSink sink(*this);
+        if (!scan(file, sink, nthreads)) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Parse CSV data in memory
+     * begin: The first character
+     * end: One past the last character
+     * nthreads: The number of threads, 0 to use all processors
+     */
+    bool parse(const char* begin, const char* end, uint nthreads = 1) {
+        ValueSink sink(*this);
+        if (!scan(begin, end, sink, nthreads)) {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Parse a CSV file, passing the rows to a sink instead of storing them
+     * file: The CSV file name
+     * sink: Receives the rows
+     * nthreads: The number of threads, 0 to use all processors
+     */
+    static bool scan(const char file[], CsvRowSink& sink, uint nthreads = 1) {
+        MappedFile f;
+        if (!f.open(file)) {
+            return false;
+        }
+        f.adviseSequential();
+        return scan(f.data(), f.data() + f.size(), sink, nthreads);
+    }
+
+    /**
+     * Parse CSV data in memory, passing the rows to a sink. Errors are
+     * reported with the same line numbers whatever the number of threads.
+     * begin: The first character
+     * end: One past the last character
+     * sink: Receives the rows
+     * nthreads: The number of threads, 0 to use all processors
+     */
+    static bool scan(const char* begin, const char* end, CsvRowSink& sink,
+                     uint nthreads = 1) {
+        // Numbers are parsed in place, so copy the last line if it isn't
+        // terminated
+        std::string last;
+        if (begin < end && end[-1] != '\n') {
+            const char* p = end;
+            while (p > begin && p[-1] != '\n') {
+                --p;
+            }
+            last.assign(p, end);
+            last += '\n';
+            end = p;
+        }
+
+        ThreadPool pool(nthreads);
+        std::vector<Chunk> chunks;
+        split(begin, end, pool.size() == 1? 1: pool.size() * 4, chunks);
+        if (!last.empty()) {
+            chunks.push_back(Chunk(last.data(), last.data() + last.size()));
+        }
+
+        if (chunks.empty()) {
+            sink.resize(0, 0);
+            return true;
+        }
+
+        // The first line sets the number of columns
+        const char* p = chunks[0].begin;
+        const char* eol = static_cast<const char*>(
+            std::memchr(p, '\n', chunks[0].end - p));
+        DoubleArray first;
+        int cols = parseLine(p, eol, first);
+        if (cols < 0) {
+            return lineError(0, 0, -1);
+        }
+        if (cols < 1) {
+            LOG(Log::ERROR) << "Line 0 was empty";
+            return false;
+        }
+
+        ScanTask task(chunks, sink, cols, pool.size());
+        pool.run(task, chunks.size());
+
+        uint rows = 0;
+        for (uint i = 0; i < chunks.size(); ++i) {
+            chunks[i].first = rows;
+            rows += chunks[i].lines;
+        }
+
+        sink.resize(rows, cols);
+        task.store();
+        pool.run(task, chunks.size());
+
+        // Each chunk stops at its first error, so the first chunk with an
+        // error contains the first error in the file
+        for (uint i = 0; i < chunks.size(); ++i) {
+            if (chunks[i].error != uint(-1)) {
+                return lineError(chunks[i].first + chunks[i].error, cols,
+                                 chunks[i].found);
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Return the number of rows
+     */
+    uint rows() const {
+        return m_rows;
+    }
+
+    /**
+     * Return the number of columns
+     */
+    uint cols() const {
+        return m_cols;
+    }
+
+    /**
+     * Get an element
+     * r: Row index
+     * c: Column index
+     */
+    double operator()(uint r, uint c) const {
+        return m_values[size_t(r) * m_cols + c];
+    }
+
+    /**
+     * Get a row of cols() values
+     * r: Row index
+     */
+    const double* row(uint r) const {
+        return &m_values[size_t(r) * m_cols];
+    }
+
+    /**
+     * Split a line into numbers around commas, consecutive commas are
+     * treated as one. The line must be followed by a character which isn't
+     * part of a number, such as the newline.
+     * p: Start of the line
+     * eol: End of the line
+     * x: Vector to which the numbers will be appended
+     * Returns the number of tokens, or -1 if a token isn't a number
+     */
+    static int parseLine(const char* p, const char* eol, DoubleArray& x) {
+        // A line of n characters can't hold more than n / 2 + 1 tokens
+        size_t size = x.size();
+        x.resize(size + (eol - p) / 2 + 1);
+        int n = parseLine(p, eol, &x[size], x.size() - size);
+        x.resize(size + std::max(n, 0));
+        return n;
+    }
+
+    /**
+     * Split a line into numbers, as above
+     * p: Start of the line
+     * eol: End of the line
+     * x: Array in which the numbers will be stored
+     * size: The size of x, further tokens are checked and counted but not
+     *       stored
+     * Returns the number of tokens, or -1 if a token isn't a number
+     */
+    static int parseLine(const char* p, const char* eol, double* x,
+                         uint size) {
+        while (eol > p && eol[-1] == '\r') {
+            --eol;
+        }
+
+        int n = 0;
+        while (true) {
+            while (p < eol && *p == ',') {
+                ++p;
+            }
+            if (p == eol) {
+                return n;
+            }
+
+            const char* tokEnd = static_cast<const char*>(
+                std::memchr(p, ',', eol - p));
+            if (!tokEnd) {
+                tokEnd = eol;
+            }
+
+            double d;
+            const char* q = parseNumber(p, d);
+            if (q == p || q > tokEnd) {
+                return -1;
+            }
+            // Only blanks may follow the number
+            while (q < tokEnd && (*q == ' ' || *q == '\t')) {
+                ++q;
+            }
+            if (q != tokEnd) {
+                return -1;
+            }
+            if (uint(n) < size) {
+                x[n] = d;
+            }
+            ++n;
+            p = tokEnd;
+        }
+    }
+
+    /**
+     * Parse a number, the same as strtod but faster for plain decimals
+     * p: The number, must be followed by a character which isn't part of it
+     * x: Set to the value
+     * Returns a pointer to the character after the number, p if there isn't
+     * one
+     */
+    static const char* parseNumber(const char* p, double& x) {
+        // Decimals with a mantissa below 2^53 and a power of ten which is
+        // exactly representable are converted with one correctly rounded
+        // multiplication or division, everything else uses strtod
+        static const double pow10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        const unsigned long long maxExact = 1ull << 53;
+
+        const char* s = p;
+        bool neg = *s == '-';
+        if (*s == '-' || *s == '+') {
+            ++s;
+        }
+
+        unsigned long long m = 0;
+        int ndigits = 0;
+        int exp10 = 0;
+        for (; *s >= '0' && *s <= '9'; ++s, ++ndigits) {
+            m = m * 10 + (*s - '0');
+        }
+        if (*s == '.') {
+            for (++s; *s >= '0' && *s <= '9'; ++s, ++ndigits, --exp10) {
+                m = m * 10 + (*s - '0');
+            }
+        }
+        if (ndigits > 0 && (*s == 'e' || *s == 'E')) {
+            const char* e = s + 1;
+            bool eneg = *e == '-';
+            if (*e == '-' || *e == '+') {
+                ++e;
+            }
+            if (*e >= '0' && *e <= '9') {
+                int n = 0;
+                for (; *e >= '0' && *e <= '9' && n < 10000; ++e) {
+                    n = n * 10 + (*e - '0');
+                }
+                exp10 += eneg? -n: n;
+                s = e;
+            }
+        }
+
+        if (ndigits == 0 || ndigits > 18 || m > maxExact ||
+            exp10 < -22 || exp10 > 22 || (*s >= '0' && *s <= '9') ||
+            *s == 'x' || *s == 'X') {
+            char* q;
+            x = std::strtod(p, &q);
+            return q;
+        }
+
+        x = exp10 < 0? m / pow10[-exp10]: m * pow10[exp10];
+        if (neg) {
+            x = -x;
+        }
+        return s;
+    }
+
+protected:
+    /**
+     * A range of complete lines
+     */
+    struct Chunk
+    {
+        Chunk(const char* b, const char* e):
+            begin(b), end(e), lines(0), first(0), error(uint(-1)),
+            found(0) {
+        }
+
+        const char* begin;
+        const char* end;
+
+        /**
+         * The number of lines
+         */
+        uint lines;
+
+        /**
+         * The index of the first line in the file
+         */
+        uint first;
+
+        /**
+         * The index in this chunk of the first bad line, uint(-1) if none
+         */
+        uint error;
+
+        /**
+         * The number of tokens on the bad line, -1 if one isn't a number
+         */
+        int found;
+    };
+
+    /**
+     * Counts the lines of each chunk, then once store() is called parses
+     * them
+     */
+    class ScanTask: public ParallelTask
+    {
+    public:
+        ScanTask(std::vector<Chunk>& chunks, CsvRowSink& sink, uint cols,
+                 uint nthreads):
+            m_chunks(chunks), m_sink(sink), m_cols(cols), m_store(false),
+            m_rows(nthreads, DoubleArray(cols)) {
+        }
+
+        void store() {
+            m_store = true;
+        }
+
+        virtual void run(uint n, uint thread) {
+            Chunk& c = m_chunks[n];
+            if (!m_store) {
+                c.lines = std::count(c.begin, c.end, '\n');
+                return;
+            }
+
+            double* x = &m_rows[thread][0];
+            const char* p = c.begin;
+            for (uint r = 0; r < c.lines; ++r) {
+                const char* eol = static_cast<const char*>(
+                    std::memchr(p, '\n', c.end - p));
+                int k = parseLine(p, eol, x, m_cols);
+                if (k != int(m_cols)) {
+                    c.error = r;
+                    c.found = k;
+                    return;
+                }
+                m_sink.setRow(c.first + r, x);
+                p = eol + 1;
+            }
+        }
+
+    private:
+        std::vector<Chunk>& m_chunks;
+        CsvRowSink& m_sink;
+        uint m_cols;
+        bool m_store;
+
+        /**
+         * A row buffer for each thread
+         */
+        std::vector<DoubleArray> m_rows;
+    };
+
+    /**
+     * Stores the rows in m_values
+     */
+    class ValueSink: public CsvRowSink
+    {
+    public:
+        ValueSink(MappedCsvReader& csv):
+            m_csv(csv) {
+        }
+
+        virtual void resize(uint rows, uint cols) {
+            m_csv.m_rows = rows;
+            m_csv.m_cols = cols;
+            m_csv.m_values.resize(size_t(rows) * cols);
+        }
+
+        virtual void setRow(uint r, const double* x) {
+            std::copy(x, x + m_csv.m_cols,
+                      m_csv.m_values.begin() + size_t(r) * m_csv.m_cols);
+        }
+
+    private:
+        MappedCsvReader& m_csv;
+    };
+    friend class ValueSink;
+
+    /**
+     * Split complete lines into about n chunks
+     */
+    static void split(const char* begin, const char* end, uint n,
+                      std::vector<Chunk>& chunks) {
+        size_t step = (end - begin) / n + 1;
+        const char* p = begin;
+        while (p < end) {
+            const char* q = p + std::min<size_t>(step, end - p) - 1;
+            q = static_cast<const char*>(std::memchr(q, '\n', end - q));
+            chunks.push_back(Chunk(p, q + 1));
+            p = q + 1;
+        }
+    }
+
+    /**
+     * Report a bad line, always returns false
+     * line: The line index
+     * cols: The expected number of tokens
+     * found: The number of tokens, -1 if one isn't a number
+     */
+    static bool lineError(uint line, uint cols, int found) {
+        if (found < 0) {
+            LOG(Log::ERROR) << "Line " << line << " contains a token "
+                            << "which isn't a number";
+        }
+        else {
+            LOG(Log::ERROR) << "Line " << line << " expected "
+                            << cols << " tokens, found " << found;
+        }
+        return false;
+    }
+
+    /**
+     * Remove all values
+     */
+    void clear() {
+        m_values.clear();
+        m_rows = 0;
+        m_cols = 0;
+    }
+
+private:
+    /**
+     * The number of rows
+     */
+    uint m_rows;
+
+    /**
+     * The number of columns
+     */
+    uint m_cols;
+
+    /**
+     * The values, m_values[r * m_cols + c]
+     */
+    DoubleArray m_values;
+};
+
+
+/**
+ * Load a numeric CSV file with one sample per line directly into the
+ * columns of a SingleMatrixDataset. The number of lines is counted before
+ * parsing so the dataset is allocated once at its final size, and there is
+ * no intermediate copy of the values.
+ */
+class CsvDatasetReader: public CsvRowSink
+{
+public:
+    /**
+     * Read a dataset
+     * file: The CSV file name
+     * labelCol: The column holding the class label, -1 for the last column,
+     *           all other columns are features
+     * nthreads: The number of threads, 0 to use all processors
+     * categorical: The columns holding categorical features
+     * Returns the dataset, or NULL on error
+     */
+    static Dataset::Ptr read(const char file[], int labelCol = -1,
+                             uint nthreads = 1,
+                             const UintArray& categorical = UintArray()) {
+        SingleMatrixDataset* d = new SingleMatrixDataset(0, 0);
+        Dataset::Ptr pd(d);
+
+        CsvDatasetReader sink(*d, labelCol);
+        if (!MappedCsvReader::scan(file, sink, nthreads)) {
+            return NULL;
+        }
+        if (sink.m_cols < 2) {
+            LOG(Log::ERROR) << "Expected at least 2 columns, found "
+                            << sink.m_cols;
+            return NULL;
+        }
+        if (sink.m_labelCol >= sink.m_cols) {
+            LOG(Log::ERROR) << "Label column " << sink.m_labelCol
+                            << " doesn't exist, found " << sink.m_cols
+                            << " columns";
+            return NULL;
+        }
+
+        for (uint i = 0; i < categorical.size(); ++i) {
+            uint c = categorical[i];
+            if (c >= sink.m_cols || c == sink.m_labelCol) {
+                LOG(Log::ERROR) << "Categorical column " << c
+                                << " isn't a feature column";
+                return NULL;
+            }
+            uint ftid = c < sink.m_labelCol? c: c - 1;
+            d->setCategorical(ftid);
+            checkCategories(*d, ftid, c);
+        }
+
+        d->countClasses();
+        return pd;
+    }
+
+    /**
+     * Parse a comma separated list of column numbers, such as "0,3,4"
+     * s: The list
+     * cols: Set to the column numbers
+     * Returns false if the list is invalid
+     */
+    static bool parseColumns(const char* s, UintArray& cols) {
+        cols.clear();
+        while (*s) {
+            char* end;
+            unsigned long c = std::strtoul(s, &end, 10);
+            if (end == s || *s < '0' || *s > '9' || c >= uint(-1) ||
+                (*end != ',' && *end != '\0')) {
+                LOG(Log::ERROR) << "Invalid column list: " << s;
+                return false;
+            }
+            cols.push_back(c);
+            s = *end? end + 1: end;
+        }
+        return true;
+    }
+
+    virtual void resize(uint rows, uint cols) {
+        m_cols = cols;
+        if (m_labelCol == uint(-1)) {
+            m_labelCol = cols - 1;
+        }
+        if (cols > 1 && m_labelCol < cols) {
+            m_data.resize(rows, cols - 1);
+        }
+    }
+
+    virtual void setRow(uint r, const double* x) {
+        if (m_cols < 2 || m_labelCol >= m_cols) {
+            return;
+        }
+
+        for (uint c = 0; c < m_labelCol; ++c) {
+            m_data.setX(r, c, x[c]);
+        }
+        for (uint c = m_labelCol + 1; c < m_cols; ++c) {
+            m_data.setX(r, c - 1, x[c]);
+        }
+        m_data.setLabelOnly(r, x[m_labelCol]);
+    }
+
+protected:
+    CsvDatasetReader(SingleMatrixDataset& data, int labelCol):
+        m_data(data), m_labelCol(labelCol), m_cols(0) {
+    }
+
+    /**
+     * Warn if a categorical feature has values which aren't categories,
+     * these are all treated as one category which always goes left
+     * data: The dataset
+     * ftid: The categorical feature
+     * col: The column of the feature in the file
+     */
+    static void checkCategories(const SingleMatrixDataset& data, uint ftid,
+                                uint col) {
+        // The categories of SplitSelector
+        const uint MaxCategories = 64;
+
+        const FtvalArray& xs = data.columns()[ftid];
+        uint bad = 0;
+        Ftval example = 0;
+        for (uint r = 0; r < xs.size(); ++r) {
+            Ftval x = xs[r];
+            // NaN is a missing value
+            if (x == x && !(x >= 0 && x < MaxCategories && x == uint(x))) {
+                if (bad++ == 0) {
+                    example = x;
+                }
+            }
+        }
+        if (bad > 0) {
+            LOG(Log::WARNING) << "Categorical column " << col << " has "
+                              << bad << " values which aren't integers in "
+                              << "[0, " << MaxCategories
+                              << "), such as " << example;
+        }
+    }
+
+private:
+    /**
+     * The dataset being filled
+     */
+    SingleMatrixDataset& m_data;
+
+    /**
+     * The label column, uint(-1) for the last column until the number of
+     * columns is known
+     */
+    uint m_labelCol;
+
+    /**
+     * The number of columns in the file
+     */
+    uint m_cols;
+};
+
+
+
+/**
+ * Read a sparse dataset in libsvm format, one sample per line:
+ *   label index:value index:value ...
+ * Labels are non-negative integers, indices start at 1 and must be
+ * ascending on each line, missing indices are zero
+ */
+class LibsvmDatasetReader
+{
+public:
+    /**
+     * Read a dataset
+     * file: The libsvm file name
+     * Returns the dataset, or NULL on error
+     */
+    static Dataset::Ptr read(const char file[]) {
+        MappedFile mf;
+        if (!mf.open(file)) {
+            return NULL;
+        }
+        mf.adviseSequential();
+
+        LibsvmDatasetReader reader;
+        const char* p = mf.data();
+        const char* end = p + mf.size();
+        for (uint line = 1; p < end; ++line) {
+            const char* eol = static_cast<const char*>(
+                std::memchr(p, '\n', end - p));
+            bool ok;
+            if (eol) {
+                ok = reader.parseLine(p);
+                p = eol + 1;
+            }
+            else {
+                // parseNumber needs a terminator after the last value
+                std::string last(p, end);
+                ok = reader.parseLine(last.c_str());
+                p = end;
+            }
+            if (!ok) {
+                LOG(Log::ERROR) << file << ":" << line
+                                << ": Invalid libsvm line";
+                return NULL;
+            }
+        }
+
+        SparseDataset* d = new SparseDataset(
+            reader.m_ls.size(), reader.m_nc, reader.m_rows, reader.m_cols,
+            reader.m_xs);
+        Dataset::Ptr pd(d);
+        for (uint r = 0; r < reader.m_ls.size(); ++r) {
+            d->setLabel(r, reader.m_ls[r]);
+        }
+        return pd;
+    }
+
+private:
+    LibsvmDatasetReader(): m_nc(0) {
+    }
+
+    /**
+     * Parse one line, blank lines are skipped
+     * p: The line, terminated by a newline or NUL
+     * Returns false if the line is invalid
+     */
+    bool parseLine(const char* p) {
+        p = skipSpace(p);
+        if (isEol(*p)) {
+            return true;
+        }
+
+        double y;
+        const char* q = MappedCsvReader::parseNumber(p, y);
+        if (q == p || !isEnd(*q) || !(y >= 0 && y < Label(-1)) ||
+            y != Label(y)) {
+            return false;
+        }
+        Id r = m_ls.size();
+        m_ls.push_back(Label(y));
+
+        uint prev = 0;
+        for (p = skipSpace(q); !isEol(*p); p = skipSpace(p)) {
+            unsigned long idx = 0;
+            for (q = p; *q >= '0' && *q <= '9' && idx <= uint(-1); ++q) {
+                idx = idx * 10 + (*q - '0');
+            }
+            if (q == p || *q != ':' || idx <= prev || idx > uint(-1)) {
+                return false;
+            }
+            prev = idx;
+
+            double x;
+            p = q + 1;
+            q = MappedCsvReader::parseNumber(p, x);
+            if (q == p || !isEnd(*q)) {
+                return false;
+            }
+            p = q;
+
+            m_rows.push_back(r);
+            m_cols.push_back(idx - 1);
+            m_xs.push_back(x);
+            m_nc = std::max(m_nc, uint(idx));
+        }
+        return true;
+    }
+
+    static const char* skipSpace(const char* p) {
+        while (*p == ' ' || *p == '\t') {
+            ++p;
+        }
+        return p;
+    }
+
+    /**
+     * True if c ends a line
+     */
+    static bool isEol(char c) {
+        return c == '\n' || c == '\r' || c == '\0';
+    }
+
+    /**
+     * True if c ends a token
+     */
+    static bool isEnd(char c) {
+        return c == ' ' || c == '\t' || isEol(c);
+    }
+
+    /**
+     * The number of features, the largest index seen
+     */
+    uint m_nc;
+
+    /**
+     * The nonzero values as (sample, feature, value) triplets
+     */
+    IdArray m_rows;
+    UintArray m_cols;
+    FtvalArray m_xs;
+
+    /**
+     * The label of each sample
+     */
+    LabelArray m_ls;
+};
+
+
 #endif // YARF_DATAIO_HPP
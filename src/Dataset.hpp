@@ -6,9 +6,144 @@
 
 #include <cassert>
 #include <algorithm>
+#include <numeric>
+#include <utility>
+#include <vector>
 #include "RFtypes.hpp"
 #include "RFutils.hpp"
 
+/**
+ * The sample ids at a node sorted by id, used to match them against the
+ * nonzeros of sparse features. Training keeps the ids of every node in
+ * ascending order (the bag is drawn in id order and splits partition it
+ * stably) so they are normally used as they are, otherwise they are sorted
+ * once the first time they are needed. Each feature then costs time
+ * proportional to its number of nonzeros instead of the number of samples.
+ */
+class SortedIdIndex
+{
+public:
+    /**
+     * ids: Array of sample ids, may contain duplicates. Must remain in scope
+     *      for the life of the index.
+     */
+    SortedIdIndex(const IdArray& ids):
+        m_ids(ids), m_checked(false) {
+    }
+
+    /**
+     * Return the sample ids
+     */
+    const IdArray& ids() const {
+        return m_ids;
+    }
+
+    /**
+     * Find the samples with a nonzero value of a feature
+     * fts: The output array to hold the nonzero feature values
+     * pos: The output array to hold the index in ids() of each value, in
+     *      ascending order
+     * rows: Sample ids of the nonzero values of the feature, ascending
+     * xs: The nonzero values
+     * nnz: Number of nonzero values
+     */
+    void selectNonzero(FtvalArray& fts, UintArray& pos, const Id* rows,
+                       const Ftval* xs, uint nnz) {
+        if (!m_checked) {
+            m_checked = true;
+            if (!m_ids.empty() &&
+                !Utils::issorted<IdArray>(m_ids.begin(), m_ids.end())) {
+                sort();
+            }
+        }
+        const IdArray& sorted = m_index.empty()? m_ids: m_sorted;
+
+        // Merge the two sorted arrays, jumping over runs of either which
+        // have no match in the other
+        IdArray::const_iterator b = sorted.begin();
+        const IdArray::const_iterator bend = sorted.end();
+        const Id* a = rows;
+        const Id* aend = rows + nnz;
+        fts.clear();
+        pos.clear();
+        while (a != aend && b != bend) {
+            if (*a < *b) {
+                a = std::lower_bound(a, aend, *b);
+            }
+            else if (*b < *a) {
+                b = std::lower_bound(b, bend, *a);
+            }
+            else {
+                for (; b != bend && *b == *a; ++b) {
+                    uint k = b - sorted.begin();
+                    pos.push_back(m_index.empty()? k: m_index[k]);
+                    fts.push_back(xs[a - rows]);
+                }
+                ++a;
+            }
+        }
+
+        if (!m_index.empty()) {
+            sortByPosition(fts, pos);
+        }
+    }
+
+protected:
+    void sort() {
+        std::vector<std::pair<Id, uint> > sorted(m_ids.size());
+        for (uint i = 0; i < m_ids.size(); ++i) {
+            sorted[i] = std::make_pair(m_ids[i], i);
+        }
+        std::sort(sorted.begin(), sorted.end());
+
+        m_sorted.resize(sorted.size());
+        m_index.resize(sorted.size());
+        for (uint i = 0; i < sorted.size(); ++i) {
+            m_sorted[i] = sorted[i].first;
+            m_index[i] = sorted[i].second;
+        }
+    }
+
+    void sortByPosition(FtvalArray& fts, UintArray& pos) {
+        m_matches.resize(pos.size());
+        for (uint i = 0; i < pos.size(); ++i) {
+            m_matches[i] = std::make_pair(pos[i], fts[i]);
+        }
+        std::sort(m_matches.begin(), m_matches.end());
+        for (uint i = 0; i < m_matches.size(); ++i) {
+            pos[i] = m_matches[i].first;
+            fts[i] = m_matches[i].second;
+        }
+    }
+
+private:
+    /**
+     * The sample ids
+     */
+    const IdArray& m_ids;
+
+    /**
+     * Whether m_ids has been checked to be in order
+     */
+    bool m_checked;
+
+    /**
+     * The sample ids sorted, only used if m_ids isn't in order
+     */
+    IdArray m_sorted;
+
+    /**
+     * Index in m_ids of each element of m_sorted, empty if m_ids is in order
+     */
+    UintArray m_index;
+
+    /**
+     * Index in m_ids and value of each match, scratch for sortByPosition()
+     */
+    std::vector<std::pair<uint, Ftval> > m_matches;
+};
+
+
 /**
  * Interface to a feature
  */
@@ -32,6 +167,28 @@ public:
      */
     virtual void select(FtvalArray& fts, const IdArray& ids) const = 0;
 
+    /**
+     * Return only the nonzero values of a feature for a subset of samples,
+     * if the feature is stored sparsely. The zeros are implied.
+     * fts: The output array to hold the nonzero feature values
+     * pos: The output array to hold the index in ids of each value
+     * ids: The sample ids, shared by all features at a node
+     * Returns false if the feature isn't sparse, in which case select()
+     * should be used instead
+     */
+    virtual bool selectNonzero(FtvalArray&, UintArray&,
+                               SortedIdIndex&) const {
+        return false;
+    }
+
+    /**
+     * Return a pointer to the values of the feature for all size() samples
+     * if they are stored contiguously, otherwise NULL
+     */
+    virtual const Ftval* data() const {
+        return NULL;
+    }
+
     /**
      * Return the number of samples
      */
@@ -105,11 +262,67 @@ public:
      */
     virtual FeatureSetPtr getFeature(uint n) const = 0;
 
+    /**
+     * Return a pointer to the numSamples() values of a feature if they are
+     * stored contiguously, otherwise NULL. Unlike getFeature() nothing is
+     * allocated. The pointer remains valid until the dataset is modified.
+     * n: The feature id
+     */
+    virtual const Ftval* getColumn(uint) const {
+        return NULL;
+    }
+
+    /**
+     * Get the values of a feature for a subset of samples. Reads the column
+     * directly if it is contiguous, and doesn't allocate if fts is already
+     * large enough.
+     * fts: The output array to hold the feature values
+     * n: The feature id
+     * ids: Array of sample ids
+     */
+    void selectFeature(FtvalArray& fts, uint n, const IdArray& ids) const {
+        const Ftval* x = getColumn(n);
+        if (!x) {
+            getFeature(n)->select(fts, ids);
+            return;
+        }
+
+        fts.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            fts[i] = x[ids[i]];
+        }
+    }
+
     /**
      * Return a single sample
      */
     virtual DataSamplePtr getSample(Id id) const = 0;
 
+    /**
+     * Return the feature values of a single sample as a contiguous array of
+     * numFeatures() values. The returned pointer is either into the
+     * underlying storage or into scratch, and remains valid until scratch or
+     * the dataset is modified. Does not allocate if scratch is large enough.
+     * id: The sample id
+     * scratch: Array which may be used to hold the values
+     */
+    virtual const Ftval* getRow(Id id, FtvalArray& scratch) const {
+        DataSamplePtr d = getSample(id);
+        scratch.resize(d->size());
+        for (uint c = 0; c < scratch.size(); ++c) {
+            scratch[c] = (*d)[c];
+        }
+        return scratch.empty()? NULL: &scratch[0];
+    }
+
+    /**
+     * Return the label of a single sample
+     * id: The sample id
+     */
+    virtual Label getLabel(Id id) const {
+        return getSample(id)->label();
+    }
+
     /**
      * Return the labels of all samples
      */
@@ -131,6 +344,146 @@ public:
      * Return the number of classes
      */
     virtual uint numClasses() const = 0;
+
+    /**
+     * Return true if a feature is categorical. The values of a categorical
+     * feature are unordered categories, which should be the integers
+     * [0, 64), other values are all treated as one category.
+     * ftid: The feature id
+     */
+    virtual bool isCategorical(uint) const {
+        return false;
+    }
+};
+
+
+/**
+ * A sample whose feature values are held in a contiguous array owned by
+ * someone else. Cheap enough to be created on the stack for each prediction.
+ */
+class RowSample: public DataSample
+{
+public:
+    /**
+     * Create a sample view
+     * id: The sample id
+     * x: Array of n feature values, must remain in scope for the life of
+     *    this sample
+     * n: Number of features
+     * y: The class label
+     */
+    RowSample(Id id, const Ftval* x, uint n, Label y = Dataset::NoLabel):
+        m_id(id), m_x(x), m_n(n), m_y(y) {
+    }
+
+    virtual Ftval operator[](uint ftid) const {
+        assert(ftid < m_n);
+        return m_x[ftid];
+    }
+
+    virtual Id id() const {
+        return m_id;
+    }
+
+    virtual Label label() const {
+        return m_y;
+    }
+
+    virtual uint size() const {
+        return m_n;
+    }
+
+private:
+    /**
+     * The id of this sample
+     */
+    const Id m_id;
+
+    /**
+     * The feature values
+     */
+    const Ftval* m_x;
+
+    /**
+     * The number of features
+     */
+    const uint m_n;
+
+    /**
+     * The class label, Label(-1) if unknown
+     */
+    const Label m_y;
+};
+
+
+/**
+ * A DataSample which wraps anything with an operator[] returning the value
+ * of a feature, for code which needs the virtual interface
+ */
+template <typename SampleT>
+class DataSampleAdapter: public DataSample
+{
+public:
+    /**
+     * Create an adapter
+     * d: The sample, must remain in scope for the life of the adapter
+     * n: Number of features, 0 if unknown
+     * id: The sample id
+     * y: The class label
+     */
+    DataSampleAdapter(const SampleT& d, uint n = 0, Id id = 0,
+                      Label y = Dataset::NoLabel):
+        m_d(d), m_n(n), m_id(id), m_y(y) {
+    }
+
+    virtual Ftval operator[](uint ftid) const {
+        assert(m_n == 0 || ftid < m_n);
+        return m_d[ftid];
+    }
+
+    virtual Id id() const {
+        return m_id;
+    }
+
+    virtual Label label() const {
+        return m_y;
+    }
+
+    virtual uint size() const {
+        return m_n;
+    }
+
+private:
+    const SampleT& m_d;
+    const uint m_n;
+    const Id m_id;
+    const Label m_y;
+};
+
+
+/**
+ * A view of a sample with the value of one feature replaced, used to
+ * predict a permuted feature without copying the sample
+ */
+template <typename SampleT>
+struct ReplacedFeatureSample
+{
+    /**
+     * d: The sample, must remain in scope for the life of the view
+     * ftid: The id of the replaced feature
+     * x: The value of feature ftid
+     */
+    ReplacedFeatureSample(const SampleT& d, uint ftid, Ftval x):
+        d(d), ftid(ftid), x(x) {
+    }
+
+    Ftval operator[](uint n) const {
+        return n == ftid? x: d[n];
+    }
+
+    const SampleT& d;
+    uint ftid;
+    Ftval x;
 };
 
 
@@ -193,6 +546,10 @@ public:
         Utils::extract(fts, m_x, ids);
     }
 
+    virtual const Ftval* data() const {
+        return m_x.empty()? NULL: &m_x[0];
+    }
+
     virtual uint size() const {
         return m_x.size();
     }
@@ -208,14 +565,8 @@ class SingleMatrixDataset: public Dataset
 {
 public:
     SingleMatrixDataset(uint nr, uint nc):
-        m_ids(nr), m_xs(nc), m_ys(nr), m_numClasses(0) {
-        for (uint c = 0; c < nc; ++c) {
-            m_xs[c].resize(nr);
-        }
-
-        for (uint r = 0; r < nr; ++r) {
-            m_ids[r] = r;
-        }
+        m_numClasses(0) {
+        resize(nr, nc);
     }
 
     void setLabel(uint r, Label l) {
@@ -239,11 +590,30 @@ public:
         return new SingleMatrixFeatureSet(m_xs[n]);
     }
 
+    virtual const Ftval* getColumn(uint n) const {
+        assert(n < numFeatures());
+        return m_xs[n].empty()? NULL: &m_xs[n][0];
+    }
+
     virtual DataSamplePtr getSample(Id id) const {
         assert(id < numSamples());
         return new SingleMatrixDataSample(id, m_xs, m_ys[id]);
     }
 
+    virtual const Ftval* getRow(Id id, FtvalArray& scratch) const {
+        assert(id < numSamples());
+        scratch.resize(numFeatures());
+        for (uint c = 0; c < scratch.size(); ++c) {
+            scratch[c] = m_xs[c][id];
+        }
+        return scratch.empty()? NULL: &scratch[0];
+    }
+
+    virtual Label getLabel(Id id) const {
+        assert(id < numSamples());
+        return m_ys[id];
+    }
+
     virtual LabelArrayPtr getLabels() const {
         return new LabelArray(m_ys);
     }
@@ -260,17 +630,77 @@ public:
         return m_numClasses;
     }
 
+    virtual bool isCategorical(uint ftid) const {
+        assert(ftid < numFeatures());
+        return m_categorical[ftid];
+    }
+
     // Additional methods specific to this class
     void setX(uint r, uint c, Ftval x) {
         assert(r < numSamples() && c < numFeatures());
         m_xs[c][r] = x;
     }
 
+    /**
+     * Declare whether a feature is categorical
+     * c: The feature id
+     * categorical: true if the feature is categorical
+     */
+    void setCategorical(uint c, bool categorical = true) {
+        assert(c < numFeatures());
+        m_categorical[c] = categorical;
+    }
+
     Ftval getX(uint r, uint c) const {
         assert(r < numSamples() && c < numFeatures());
         return m_xs[c][r];
     }
 
+    /**
+     * Get the feature columns, accessed in order columns()[feature][sample]
+     */
+    const std::vector<FtvalArray>& columns() const {
+        return m_xs;
+    }
+
+    /**
+     * Change the number of samples and features, existing values are kept
+     * where they fit and new values are 0
+     * nr: Number of samples
+     * nc: Number of features
+     */
+    void resize(uint nr, uint nc) {
+        m_xs.resize(nc);
+        m_categorical.resize(nc);
+        for (uint c = 0; c < nc; ++c) {
+            m_xs[c].resize(nr);
+        }
+        m_ys.resize(nr);
+
+        m_ids.resize(nr);
+        for (uint r = 0; r < nr; ++r) {
+            m_ids[r] = r;
+        }
+    }
+
+    /**
+     * Set a label without updating the number of classes, so labels of
+     * different samples can be set concurrently. Call countClasses() once
+     * all labels are set.
+     */
+    void setLabelOnly(uint r, Label l) {
+        assert(r < m_ys.size());
+        m_ys[r] = l;
+    }
+
+    /**
+     * Set the number of classes from the labels
+     */
+    void countClasses() {
+        m_numClasses = m_ys.empty()? 0:
+            *std::max_element(m_ys.begin(), m_ys.end()) + 1;
+    }
+
 private:
     /**
      * Array of sample ids
@@ -282,6 +712,11 @@ private:
      */
     std::vector<FtvalArray> m_xs;
 
+    /**
+     * Whether each feature is categorical
+     */
+    std::vector<bool> m_categorical;
+
     /**
      * Vector of class labels
      */
@@ -295,136 +730,689 @@ private:
 
 
 /**
- * A class which permutes a feature, intended for use with variable importance
- * calculations
+ * A feature of a row-major matrix
  */
-class PermutedFeatureDataset: public Dataset
+class StridedFeatureSet: public FeatureSet
 {
 public:
     /**
-     * Construct a data set in which one of the feature values are permuted
-     * data: The underlying dataset
-     * ftid: The feature id of the feature to be permuted
+     * Create a feature view
+     * x: Pointer to the value of the feature for the first sample
+     * n: Number of samples
+     * stride: Distance between the values of consecutive samples
      */
-    PermutedFeatureDataset(const Dataset& data, uint ftid):
-        m_data(data), m_permute(ftid) {
-        permuteFeature(ftid);
+    StridedFeatureSet(const Ftval* x, uint n, uint stride):
+        m_x(x), m_n(n), m_stride(stride) {
     }
 
-    virtual uint numFeatures() const {
-        return m_data.numFeatures();
+    virtual Ftval operator[](Id id) const {
+        assert(id < m_n);
+        return m_x[id * m_stride];
     }
 
-    virtual uint numSamples() const {
-        return m_data.numSamples();
+    virtual void select(FtvalArray& fts, const IdArray& ids) const {
+        fts.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            fts[i] = (*this)[ids[i]];
+        }
+    }
+
+    virtual const Ftval* data() const {
+        return m_stride == 1? m_x: NULL;
+    }
+
+    virtual uint size() const {
+        return m_n;
     }
 
+private:
     /**
-     * Return a single feature for all samples, possibly permuted
+     * Pointer to the first value
      */
-    virtual FeatureSetPtr getFeature(uint n) const {
-        if (n == m_permute) {
-            return new SingleMatrixFeatureSet(m_permutedValues);
-        }
+    const Ftval* m_x;
 
-        return m_data.getFeature(n);
-    }
+    /**
+     * Number of samples
+     */
+    const uint m_n;
 
     /**
-     * Return a single sample, possibly with a permuted feature
+     * Distance between values
      */
-    virtual DataSamplePtr getSample(Id id) const {
-        return new PermutedFeatureDataSample(
-            m_data.getSample(id), m_permute, m_permutedValues[m_permute]);
-    }
+    const uint m_stride;
+};
 
-    virtual LabelArrayPtr getLabels() const {
-        return m_data.getLabels();
-    }
 
-    virtual void selectLabels(LabelArray& ls, const IdArray& ids) const {
-        return m_data.selectLabels(ls, ids);
+/**
+ * A dataset stored in row-major order, so that all features of a sample are
+ * contiguous. Intended for prediction, where each sample is visited once and
+ * its features are read repeatedly.
+ */
+class DenseRowDataset: public Dataset
+{
+public:
+    DenseRowDataset(uint nr, uint nc):
+        m_nr(nr), m_nc(nc), m_xs(nr * nc), m_categorical(nc), m_ys(nr),
+        m_numClasses(0) {
     }
 
-    virtual void getIds(IdArray& ids) const {
-        return m_data.getIds(ids);
+    /**
+     * Create a row-major copy of another dataset
+     * data: The dataset to be copied
+     */
+    DenseRowDataset(const Dataset& data):
+        m_nr(data.numSamples()), m_nc(data.numFeatures()),
+        m_xs(m_nr * m_nc), m_categorical(m_nc), m_ys(m_nr),
+        m_numClasses(data.numClasses()) {
+        FtvalArray scratch;
+        for (Id r = 0; r < m_nr; ++r) {
+            const Ftval* x = data.getRow(r, scratch);
+            std::copy(x, x + m_nc, m_xs.begin() + r * m_nc);
+            m_ys[r] = data.getLabel(r);
+        }
+        for (uint c = 0; c < m_nc; ++c) {
+            m_categorical[c] = data.isCategorical(c);
+        }
     }
 
-    virtual uint numClasses() const {
-        return m_data.numClasses();
+    void setLabel(uint r, Label l) {
+        assert(r < numSamples());
+        m_ys[r] = l;
+        if (l >= m_numClasses) {
+            m_numClasses = l + 1;
+        }
+    }
+
+    virtual uint numFeatures() const {
+        return m_nc;
+    }
+
+    virtual uint numSamples() const {
+        return m_nr;
+    }
+
+    virtual FeatureSetPtr getFeature(uint n) const {
+        assert(n < numFeatures());
+        return new StridedFeatureSet(&m_xs[n], m_nr, m_nc);
+    }
+
+    virtual DataSamplePtr getSample(Id id) const {
+        assert(id < numSamples());
+        return new RowSample(id, row(id), m_nc, m_ys[id]);
+    }
+
+    virtual const Ftval* getRow(Id id, FtvalArray&) const {
+        assert(id < numSamples());
+        return row(id);
+    }
+
+    virtual Label getLabel(Id id) const {
+        assert(id < numSamples());
+        return m_ys[id];
+    }
+
+    virtual LabelArrayPtr getLabels() const {
+        return new LabelArray(m_ys);
+    }
+
+    virtual void selectLabels(LabelArray& ls, const IdArray& ids) const {
+        Utils::extract(ls, m_ys, ids);
+    }
+
+    virtual void getIds(IdArray& ids) const {
+        ids.resize(m_nr);
+        for (uint r = 0; r < m_nr; ++r) {
+            ids[r] = r;
+        }
+    }
+
+    virtual uint numClasses() const {
+        return m_numClasses;
+    }
+
+    virtual bool isCategorical(uint ftid) const {
+        assert(ftid < numFeatures());
+        return m_categorical[ftid];
+    }
+
+    // Additional methods specific to this class
+    void setX(uint r, uint c, Ftval x) {
+        assert(r < numSamples() && c < numFeatures());
+        m_xs[r * m_nc + c] = x;
+    }
+
+    /**
+     * Declare whether a feature is categorical
+     * c: The feature id
+     * categorical: true if the feature is categorical
+     */
+    void setCategorical(uint c, bool categorical = true) {
+        assert(c < numFeatures());
+        m_categorical[c] = categorical;
+    }
+
+    Ftval getX(uint r, uint c) const {
+        assert(r < numSamples() && c < numFeatures());
+        return m_xs[r * m_nc + c];
+    }
+
+    /**
+     * Get the feature values of a sample
+     */
+    const Ftval* row(uint r) const {
+        return &m_xs[r * m_nc];
+    }
+
+private:
+    /**
+     * Number of samples
+     */
+    uint m_nr;
+
+    /**
+     * Number of features
+     */
+    uint m_nc;
+
+    /**
+     * Matrix of samples, accessed in order m_xs[sample * m_nc + feature]
+     */
+    FtvalArray m_xs;
+
+    /**
+     * Whether each feature is categorical
+     */
+    std::vector<bool> m_categorical;
+
+    /**
+     * Vector of class labels
+     */
+    LabelArray m_ys;
+
+    /**
+     * Number of class labels
+     */
+    uint m_numClasses;
+};
+
+
+/**
+ * A feature stored as the sorted sample ids and values of its nonzeros
+ */
+class SparseFeatureSet: public FeatureSet
+{
+public:
+    /**
+     * Create a feature view
+     * rows: Sample ids of the nonzero values, in ascending order
+     * xs: The nonzero values
+     * nnz: Number of nonzero values
+     * n: Number of samples
+     */
+    SparseFeatureSet(const Id* rows, const Ftval* xs, uint nnz, uint n):
+        m_rows(rows), m_xs(xs), m_nnz(nnz), m_n(n) {
+    }
+
+    virtual Ftval operator[](Id id) const {
+        assert(id < m_n);
+        const Id* p = std::lower_bound(m_rows, m_rows + m_nnz, id);
+        return (p != m_rows + m_nnz && *p == id)? m_xs[p - m_rows]: 0;
+    }
+
+    virtual void select(FtvalArray& fts, const IdArray& ids) const {
+        fts.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            fts[i] = (*this)[ids[i]];
+        }
+    }
+
+    virtual bool selectNonzero(FtvalArray& fts, UintArray& pos,
+                               SortedIdIndex& ids) const {
+        fts.clear();
+        pos.clear();
+        if (m_nnz > 0) {
+            ids.selectNonzero(fts, pos, m_rows, m_xs, m_nnz);
+        }
+        return true;
+    }
+
+    virtual uint size() const {
+        return m_n;
+    }
+
+private:
+    /**
+     * Sample ids of the nonzero values
+     */
+    const Id* m_rows;
+
+    /**
+     * The nonzero values
+     */
+    const Ftval* m_xs;
+
+    /**
+     * Number of nonzero values
+     */
+    const uint m_nnz;
+
+    /**
+     * Number of samples
+     */
+    const uint m_n;
+};
+
+
+/**
+ * A dataset in compressed sparse column form, only the nonzero values of
+ * each feature are stored, so memory scales with the number of nonzeros.
+ * Split selection handles the implicit zeros of a feature as a single block.
+ */
+class SparseDataset: public Dataset
+{
+public:
+    /**
+     * Create a dataset with no features
+     * nr: Number of samples
+     */
+    SparseDataset(uint nr):
+        m_nr(nr), m_starts(1, 0), m_ys(nr), m_numClasses(0) {
+    }
+
+    /**
+     * Create a sparse copy of another dataset
+     * data: The dataset to be copied
+     */
+    SparseDataset(const Dataset& data):
+        m_nr(data.numSamples()), m_starts(1, 0), m_ys(m_nr),
+        m_numClasses(data.numClasses()) {
+        IdArray ids;
+        data.getIds(ids);
+        FtvalArray fts;
+        for (uint c = 0; c < data.numFeatures(); ++c) {
+            data.selectFeature(fts, c, ids);
+            addFeature(ids, fts);
+            m_categorical[c] = data.isCategorical(c);
+        }
+        data.selectLabels(m_ys, ids);
+    }
+
+    /**
+     * Create a dataset from its nonzero values, without a dense copy. Each
+     * (row, column) pair must occur at most once, zero values are dropped.
+     * nr: Number of samples
+     * nc: Number of features
+     * rows: Sample id of each value
+     * cols: Feature id of each value
+     * xs: The values
+     */
+    SparseDataset(uint nr, uint nc, const IdArray& rows,
+                  const UintArray& cols, const FtvalArray& xs):
+        m_nr(nr), m_starts(nc + 1, 0), m_categorical(nc), m_ys(nr),
+        m_numClasses(0) {
+        assert(rows.size() == cols.size() && rows.size() == xs.size());
+
+        // Counting sort by feature, which keeps the order of the samples
+        for (uint i = 0; i < xs.size(); ++i) {
+            assert(rows[i] < nr && cols[i] < nc);
+            if (xs[i] != 0) {
+                ++m_starts[cols[i] + 1];
+            }
+        }
+        std::partial_sum(m_starts.begin(), m_starts.end(), m_starts.begin());
+
+        m_rows.resize(m_starts.back());
+        m_xs.resize(m_starts.back());
+        UintArray next(m_starts.begin(), m_starts.end() - 1);
+        for (uint i = 0; i < xs.size(); ++i) {
+            if (xs[i] != 0) {
+                uint k = next[cols[i]]++;
+                m_rows[k] = rows[i];
+                m_xs[k] = xs[i];
+            }
+        }
+
+        // Only needed if the values weren't given in sample order
+        std::vector<std::pair<Id, Ftval> > sorted;
+        for (uint c = 0; c < nc; ++c) {
+            uint a = m_starts[c];
+            uint b = m_starts[c + 1];
+            if (b - a < 2 || Utils::issorted<IdArray>(m_rows.begin() + a,
+                                                      m_rows.begin() + b)) {
+                continue;
+            }
+            sorted.resize(b - a);
+            for (uint k = a; k < b; ++k) {
+                sorted[k - a] = std::make_pair(m_rows[k], m_xs[k]);
+            }
+            std::sort(sorted.begin(), sorted.end());
+            for (uint k = a; k < b; ++k) {
+                m_rows[k] = sorted[k - a].first;
+                m_xs[k] = sorted[k - a].second;
+            }
+        }
+    }
+
+    /**
+     * Add the next feature, zero values are dropped
+     * rows: Sample ids, in ascending order
+     * xs: The values for each sample id
+     */
+    void addFeature(const IdArray& rows, const FtvalArray& xs) {
+        assert(rows.size() == xs.size());
+        for (uint i = 0; i < rows.size(); ++i) {
+            assert(rows[i] < m_nr && (i == 0 || rows[i] > rows[i - 1]));
+            if (xs[i] != 0) {
+                m_rows.push_back(rows[i]);
+                m_xs.push_back(xs[i]);
+            }
+        }
+        m_starts.push_back(m_xs.size());
+        m_categorical.push_back(false);
+    }
+
+    void setLabel(uint r, Label l) {
+        assert(r < numSamples());
+        m_ys[r] = l;
+        if (l >= m_numClasses) {
+            m_numClasses = l + 1;
+        }
+    }
+
+    virtual uint numFeatures() const {
+        return m_starts.size() - 1;
+    }
+
+    virtual uint numSamples() const {
+        return m_nr;
+    }
+
+    virtual FeatureSetPtr getFeature(uint n) const {
+        assert(n < numFeatures());
+        uint nnz = m_starts[n + 1] - m_starts[n];
+        return new SparseFeatureSet(
+            nnz? &m_rows[m_starts[n]]: NULL, nnz? &m_xs[m_starts[n]]: NULL,
+            nnz, m_nr);
+    }
+
+    virtual DataSamplePtr getSample(Id id) const {
+        assert(id < numSamples());
+        return new SparseDataSample(id, *this);
+    }
+
+    virtual Label getLabel(Id id) const {
+        assert(id < numSamples());
+        return m_ys[id];
+    }
+
+    virtual LabelArrayPtr getLabels() const {
+        return new LabelArray(m_ys);
+    }
+
+    virtual void selectLabels(LabelArray& ls, const IdArray& ids) const {
+        Utils::extract(ls, m_ys, ids);
+    }
+
+    virtual void getIds(IdArray& ids) const {
+        ids.resize(m_nr);
+        for (uint r = 0; r < m_nr; ++r) {
+            ids[r] = r;
+        }
+    }
+
+    virtual uint numClasses() const {
+        return m_numClasses;
+    }
+
+    virtual bool isCategorical(uint ftid) const {
+        assert(ftid < numFeatures());
+        return m_categorical[ftid];
+    }
+
+    // Additional methods specific to this class
+    /**
+     * Declare whether a feature is categorical
+     * c: The feature id
+     * categorical: true if the feature is categorical
+     */
+    void setCategorical(uint c, bool categorical = true) {
+        assert(c < numFeatures());
+        m_categorical[c] = categorical;
+    }
+
+    Ftval getX(uint r, uint c) const {
+        assert(r < numSamples() && c < numFeatures());
+        IdArray::const_iterator a = m_rows.begin() + m_starts[c];
+        IdArray::const_iterator b = m_rows.begin() + m_starts[c + 1];
+        IdArray::const_iterator p = std::lower_bound(a, b, r);
+        return (p != b && *p == r)? m_xs[p - m_rows.begin()]: 0;
+    }
+
+    /**
+     * Return the number of stored nonzero values
+     */
+    uint numNonzeros() const {
+        return m_xs.size();
     }
 
 protected:
-    class PermutedFeatureDataSample: public DataSample
+    class SparseDataSample: public DataSample
     {
     public:
-        PermutedFeatureDataSample(const DataSamplePtr sample, uint ftid,
-                                  Ftval permutedValue):
-            m_sample(sample), m_permute(ftid), m_permutedValue(permutedValue) {
+        SparseDataSample(Id id, const SparseDataset& data):
+            m_id(id), m_data(data) {
         }
 
         virtual Ftval operator[](uint ftid) const {
-            if (ftid == m_permute) {
-                return m_permutedValue;
-            }
-            return (*m_sample)[ftid];
+            return m_data.getX(m_id, ftid);
         }
 
         virtual Id id() const {
-            return m_sample->id();
+            return m_id;
         }
 
         virtual Label label() const {
-            return m_sample->label();
+            return m_data.getLabel(m_id);
         }
 
         virtual uint size() const {
-            return m_sample->size();
+            return m_data.numFeatures();
         }
 
     private:
         /**
-         * Reference to the underlying data sample
+         * The id of this sample
          */
-        const DataSamplePtr m_sample;
+        const Id m_id;
 
         /**
-         * The id of the permuted feature
+         * Reference to the underlying dataset
          */
-        const uint m_permute;
-
-        /**
-         * The value of the permuted feature
-         */
-        const Ftval m_permutedValue;
+        const SparseDataset& m_data;
     };
 
-    void permuteFeature(uint ftid) {
-        IdArray ids;
-        m_data.getIds(ids);
-        FeatureSetPtr ft = getFeature(ftid);
+private:
+    /**
+     * Number of samples
+     */
+    uint m_nr;
 
-        // Get a copy of the original feature, and permute
-        ft->select(m_permutedValues, ids);
-        std::random_shuffle(m_permutedValues.begin(), m_permutedValues.end());
-    }
+    /**
+     * The nonzeros of feature c are at [m_starts[c], m_starts[c + 1])
+     */
+    UintArray m_starts;
 
-private:
     /**
-     * The underlying dataset
+     * Sample ids of the nonzero values
      */
-    const Dataset& m_data;
+    IdArray m_rows;
 
     /**
-     *  The id of the feature to be permuted
+     * The nonzero values
      */
-    const uint m_permute;
+    FtvalArray m_xs;
 
     /**
-     * The permuted feature
+     * Whether each feature is categorical
      */
-    FtvalArray m_permutedValues;
+    std::vector<bool> m_categorical;
+
+    /**
+     * Vector of class labels
+     */
+    LabelArray m_ys;
+
+    /**
+     * Number of class labels
+     */
+    uint m_numClasses;
+};
+
+
+/**
+ * Static access to the feature values of a dataset type, used by the
+ * templated training and prediction code so that the inner loops don't make
+ * a virtual call for every value. This general version goes through the
+ * Dataset interface and works for any dataset, it is specialised for
+ * datasets whose layout is known.
+ */
+template <typename DatasetT>
+struct DatasetAccess
+{
+    /**
+     * True if every feature is stored densely, so selectFeature() is always
+     * used instead of looking for a sparse FeatureSet
+     */
+    static const bool Dense = false;
+
+    /**
+     * A view of a single sample, anything with an operator[] returning the
+     * value of a feature
+     */
+    typedef const Ftval* Sample;
+
+    /**
+     * Get a view of a sample
+     * data: The dataset
+     * id: The sample id
+     * scratch: Buffer which may be used to hold the values, the view is only
+     *          valid until it is reused
+     */
+    static Sample sample(const DatasetT& data, Id id, FtvalArray& scratch) {
+        return data.getRow(id, scratch);
+    }
+
+    /**
+     * Get the values of a feature for a subset of samples
+     * data: The dataset
+     * fts: The output array to hold the feature values
+     * n: The feature id
+     * ids: Array of sample ids
+     */
+    static void selectFeature(const DatasetT& data, FtvalArray& fts, uint n,
+                              const IdArray& ids) {
+        data.selectFeature(fts, n, ids);
+    }
 };
 
 
+template <>
+struct DatasetAccess<SingleMatrixDataset>
+{
+    static const bool Dense = true;
+
+    /**
+     * A sample read directly from the feature columns
+     */
+    struct Sample
+    {
+        Sample(const FtvalArray* xs, Id id):
+            xs(xs), id(id) {
+        }
+
+        Ftval operator[](uint ftid) const {
+            return xs[ftid][id];
+        }
+
+        const FtvalArray* xs;
+        Id id;
+    };
+
+    static Sample sample(const SingleMatrixDataset& data, Id id,
+                         FtvalArray&) {
+        assert(id < data.numSamples());
+        const std::vector<FtvalArray>& xs = data.columns();
+        return Sample(xs.empty()? NULL: &xs[0], id);
+    }
+
+    static void selectFeature(const SingleMatrixDataset& data,
+                              FtvalArray& fts, uint n, const IdArray& ids) {
+        assert(n < data.numFeatures());
+        Utils::extract(fts, data.columns()[n], ids);
+    }
+};
+
+
+template <>
+struct DatasetAccess<DenseRowDataset>
+{
+    static const bool Dense = true;
+
+    typedef const Ftval* Sample;
+
+    static Sample sample(const DenseRowDataset& data, Id id,
+                         FtvalArray&) {
+        assert(id < data.numSamples());
+        return data.row(id);
+    }
+
+    static void selectFeature(const DenseRowDataset& data, FtvalArray& fts,
+                              uint n, const IdArray& ids) {
+        assert(n < data.numFeatures());
+        fts.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            fts[i] = data.row(ids[i])[n];
+        }
+    }
+};
+
+
+
+template <>
+struct DatasetAccess<SparseDataset>
+{
+    static const bool Dense = false;
+
+    /**
+     * A sample which looks up each feature in the nonzeros of its column
+     */
+    struct Sample
+    {
+        Sample(const SparseDataset* data, Id id):
+            data(data), id(id) {
+        }
+
+        Ftval operator[](uint ftid) const {
+            return data->getX(id, ftid);
+        }
+
+        const SparseDataset* data;
+        Id id;
+    };
+
+    static Sample sample(const SparseDataset& data, Id id, FtvalArray&) {
+        assert(id < data.numSamples());
+        return Sample(&data, id);
+    }
+
+    static void selectFeature(const SparseDataset& data, FtvalArray& fts,
+                              uint n, const IdArray& ids) {
+        assert(n < data.numFeatures());
+        fts.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            fts[i] = data.getX(ids[i], n);
+        }
+    }
+};
+
 #endif // YARF_DATASET_HPP
@@ -0,0 +1,426 @@
+/**
+ * A binary columnar dataset format, and a dataset which is used directly
+ * from a memory mapping of the file
+ */
+#ifndef YARF_MAPPEDDATASET_HPP
+#define YARF_MAPPEDDATASET_HPP
+
+#include <cstring>
+#include <ostream>
+#include "RFtypes.hpp"
+#include "Dataset.hpp"
+#include "MappedFile.hpp"
+#include "Logger.hpp"
+
+
+/**
+ * A read only dataset held in a memory mapped binary file. Nothing is parsed
+ * or copied when the file is opened, feature sets point straight at the
+ * mapped columns, and the pages are shared by all processes using the same
+ * file. The format is:
+ *
+ * Header (64 bytes), all integers little-endian:
+ *   0  char[8] magic "YARFDAT"
+ *   8  u32 version
+ *   12 u32 number of features
+ *   16 u32 number of samples
+ *   20 u32 number of classes
+ *   24 u64 offset of the first feature column
+ *   32 u64 distance in bytes between the starts of consecutive columns
+ *   40 u64 offset of the labels
+ *   48 u64 offset of the categorical flags (version 2)
+ * Feature columns: for each feature f64[samples]
+ * Labels: u16[samples]
+ * Categorical flags: u8[features], 1 if the feature is categorical
+ *
+ * Columns are aligned to 64 bytes. Values are stored as the raw IEEE 754
+ * bits, so the file can only be used on platforms with the same layout.
+ */
+class MappedDataset: public Dataset
+{
+public:
+    static const uint Version = 2;
+    static const uint HeaderSize = 64;
+
+    /**
+     * Map a dataset file, returns NULL on error
+     * file: The file name
+     */
+    static MappedDataset* open(const char file[]) {
+        MappedDataset* d = new MappedDataset;
+        if (!d->m_file.open(file) || !d->parse()) {
+            delete d;
+            return NULL;
+        }
+        return d;
+    }
+
+    /**
+     * Write a dataset in the binary format, returns false on error
+     * os: The output stream, should be opened in binary mode
+     * data: The dataset
+     */
+    static bool write(std::ostream& os, const Dataset& data) {
+        if (!nativeLayout()) {
+            LOG(Log::ERROR) << "Binary datasets are not supported on this "
+                            << "platform";
+            return false;
+        }
+
+        uint nf = data.numFeatures();
+        uint ns = data.numSamples();
+        size_t stride = align(size_t(ns) * sizeof(Ftval));
+        size_t labelOffset = HeaderSize + stride * nf;
+        size_t categoricalOffset = labelOffset + size_t(ns) * sizeof(Label);
+
+        char header[HeaderSize] = {0};
+        std::memcpy(header, magic(), MagicSize);
+        le(header + 8, Version, 4);
+        le(header + 12, nf, 4);
+        le(header + 16, ns, 4);
+        le(header + 20, data.numClasses(), 4);
+        le(header + 24, HeaderSize, 8);
+        le(header + 32, stride, 8);
+        le(header + 40, labelOffset, 8);
+        le(header + 48, categoricalOffset, 8);
+        os.write(header, HeaderSize);
+
+        IdArray ids;
+        data.getIds(ids);
+        FtvalArray fts;
+        std::vector<char> pad(stride - ns * sizeof(Ftval));
+        for (uint c = 0; c < nf && ns > 0; ++c) {
+            data.selectFeature(fts, c, ids);
+            os.write(reinterpret_cast<const char*>(&fts[0]),
+                     ns * sizeof(Ftval));
+            if (!pad.empty()) {
+                os.write(&pad[0], pad.size());
+            }
+        }
+
+        LabelArrayPtr ls = data.getLabels();
+        if (ns > 0) {
+            os.write(reinterpret_cast<const char*>(&(*ls)[0]),
+                     ns * sizeof(Label));
+        }
+
+        for (uint c = 0; c < nf; ++c) {
+            os.put(data.isCategorical(c)? 1: 0);
+        }
+
+        return bool(os);
+    }
+
+    /**
+     * Check whether some data starts with the binary dataset magic number
+     */
+    static bool isDataset(const char* data, size_t size) {
+        return size >= MagicSize &&
+            std::memcmp(data, magic(), MagicSize) == 0;
+    }
+
+    virtual uint numFeatures() const {
+        return m_nc;
+    }
+
+    virtual uint numSamples() const {
+        return m_nr;
+    }
+
+    virtual FeatureSetPtr getFeature(uint n) const {
+        assert(n < numFeatures());
+        return new StridedFeatureSet(column(n), m_nr, 1);
+    }
+
+    virtual const Ftval* getColumn(uint n) const {
+        return column(n);
+    }
+
+    virtual DataSamplePtr getSample(Id id) const {
+        assert(id < numSamples());
+        return new ColumnSample(id, m_xs + id, m_nc, m_stride, m_ys[id]);
+    }
+
+    virtual const Ftval* getRow(Id id, FtvalArray& scratch) const {
+        assert(id < numSamples());
+        scratch.resize(m_nc);
+        const Ftval* x = m_xs + id;
+        for (uint c = 0; c < m_nc; ++c, x += m_stride) {
+            scratch[c] = *x;
+        }
+        return scratch.empty()? NULL: &scratch[0];
+    }
+
+    virtual Label getLabel(Id id) const {
+        assert(id < numSamples());
+        return m_ys[id];
+    }
+
+    virtual LabelArrayPtr getLabels() const {
+        return new LabelArray(m_ys, m_ys + m_nr);
+    }
+
+    virtual void selectLabels(LabelArray& ls, const IdArray& ids) const {
+        ls.resize(ids.size());
+        for (uint i = 0; i < ids.size(); ++i) {
+            assert(ids[i] < m_nr);
+            ls[i] = m_ys[ids[i]];
+        }
+    }
+
+    virtual void getIds(IdArray& ids) const {
+        ids.resize(m_nr);
+        for (uint r = 0; r < m_nr; ++r) {
+            ids[r] = r;
+        }
+    }
+
+    virtual uint numClasses() const {
+        return m_numClasses;
+    }
+
+    virtual bool isCategorical(uint ftid) const {
+        assert(ftid < numFeatures());
+        return m_categorical && m_categorical[ftid];
+    }
+
+    // Additional methods specific to this class
+    /**
+     * Get the values of a feature for all samples
+     */
+    const Ftval* column(uint c) const {
+        assert(c < numFeatures());
+        return m_xs + size_t(c) * m_stride;
+    }
+
+    /**
+     * Return the distance between the starts of consecutive columns, in
+     * values
+     */
+    size_t columnStride() const {
+        return m_stride;
+    }
+
+protected:
+    /**
+     * A sample whose feature values are spread across the columns
+     */
+    class ColumnSample: public DataSample
+    {
+    public:
+        ColumnSample(Id id, const Ftval* x, uint n, size_t stride, Label y):
+            m_id(id), m_x(x), m_n(n), m_stride(stride), m_y(y) {
+        }
+
+        virtual Ftval operator[](uint ftid) const {
+            assert(ftid < m_n);
+            return m_x[ftid * m_stride];
+        }
+
+        virtual Id id() const {
+            return m_id;
+        }
+
+        virtual Label label() const {
+            return m_y;
+        }
+
+        virtual uint size() const {
+            return m_n;
+        }
+
+    private:
+        const Id m_id;
+        const Ftval* m_x;
+        const uint m_n;
+        const size_t m_stride;
+        const Label m_y;
+    };
+
+    /**
+     * Binary dataset magic number, including the terminating null
+     */
+    static const char* magic() {
+        return "YARFDAT";
+    }
+
+    static const uint MagicSize = 8;
+
+    /**
+     * Round up to a multiple of the column alignment
+     */
+    static size_t align(size_t n) {
+        return (n + 63) & ~size_t(63);
+    }
+
+    /**
+     * Store a little-endian integer
+     */
+    static void le(char* p, unsigned long long x, uint bytes) {
+        for (uint i = 0; i < bytes; ++i) {
+            p[i] = char(x >> (8 * i));
+        }
+    }
+
+    /**
+     * Load a little-endian integer
+     */
+    static unsigned long long le(const char* p, uint bytes) {
+        unsigned long long x = 0;
+        for (uint i = 0; i < bytes; ++i) {
+            x |= (unsigned long long)(unsigned char)p[i] << (8 * i);
+        }
+        return x;
+    }
+
+    /**
+     * True if the values in the binary data can be used in place
+     */
+    static bool nativeLayout() {
+        double one = 1;
+        unsigned long long u;
+        std::memcpy(&u, &one, sizeof(u));
+        Label l = 0x0201;
+        return sizeof(Ftval) == 8 && sizeof(Label) == 2 &&
+            u == 0x3ff0000000000000ull &&
+            le(reinterpret_cast<const char*>(&l), 2) == l;
+    }
+
+    /**
+     * Validate the header of the mapped file
+     */
+    bool parse() {
+        const char* data = m_file.data();
+        size_t size = m_file.size();
+
+        if (!nativeLayout()) {
+            LOG(Log::ERROR) << "Binary datasets are not supported on this "
+                            << "platform";
+            return false;
+        }
+        if (size < HeaderSize || !data || !isDataset(data, size)) {
+            LOG(Log::ERROR) << "Not a binary dataset";
+            return false;
+        }
+        // Version 1 files have no categorical flags
+        uint version = le(data + 8, 4);
+        if (version < 1 || version > Version) {
+            LOG(Log::ERROR) << "Unsupported binary dataset version "
+                            << version;
+            return false;
+        }
+
+        m_nc = le(data + 12, 4);
+        m_nr = le(data + 16, 4);
+        m_numClasses = le(data + 20, 4);
+        size_t offset = le(data + 24, 8);
+        size_t stride = le(data + 32, 8);
+        size_t labelOffset = le(data + 40, 8);
+        size_t categoricalOffset = version > 1? le(data + 48, 8): 0;
+
+        size_t colBytes = size_t(m_nr) * sizeof(Ftval);
+        if (offset % 8 != 0 || stride % 8 != 0 || stride < colBytes ||
+            (m_nc > 0 && (offset > size ||
+                          stride > (size - offset) / m_nc)) ||
+            labelOffset % 2 != 0 || labelOffset > size ||
+            size_t(m_nr) * sizeof(Label) > size - labelOffset ||
+            (version > 1 && (categoricalOffset > size ||
+                             m_nc > size - categoricalOffset))) {
+            LOG(Log::ERROR) << "Corrupt binary dataset: invalid header";
+            return false;
+        }
+
+        m_xs = reinterpret_cast<const Ftval*>(data + offset);
+        m_stride = stride / sizeof(Ftval);
+        m_ys = reinterpret_cast<const Label*>(data + labelOffset);
+        if (version > 1) {
+            m_categorical = data + categoricalOffset;
+        }
+        return true;
+    }
+
+private:
+    MappedDataset():
+        m_nr(0), m_nc(0), m_numClasses(0), m_xs(NULL), m_stride(0),
+        m_ys(NULL), m_categorical(NULL) {
+    }
+
+    /**
+     * The mapped file
+     */
+    MappedFile m_file;
+
+    /**
+     * Number of samples
+     */
+    uint m_nr;
+
+    /**
+     * Number of features
+     */
+    uint m_nc;
+
+    /**
+     * Number of class labels
+     */
+    uint m_numClasses;
+
+    /**
+     * The first feature column, accessed in order
+     * m_xs[feature * m_stride + sample]
+     */
+    const Ftval* m_xs;
+
+    /**
+     * Distance between the starts of consecutive columns, in values
+     */
+    size_t m_stride;
+
+    /**
+     * The labels
+     */
+    const Label* m_ys;
+
+    /**
+     * Nonzero for each categorical feature, NULL if the file has no flags
+     */
+    const char* m_categorical;
+};
+
+
+template <>
+struct DatasetAccess<MappedDataset>
+{
+    static const bool Dense = true;
+
+    /**
+     * A sample read directly from the mapped columns
+     */
+    struct Sample
+    {
+        Sample(const Ftval* x, size_t stride):
+            x(x), stride(stride) {
+        }
+
+        Ftval operator[](uint ftid) const {
+            return x[ftid * stride];
+        }
+
+        const Ftval* x;
+        size_t stride;
+    };
+
+    static Sample sample(const MappedDataset& data, Id id,
+                         FtvalArray&) {
+        assert(id < data.numSamples());
+        return Sample(data.column(0) + id, data.columnStride());
+    }
+
+    static void selectFeature(const MappedDataset& data, FtvalArray& fts,
+                              uint n, const IdArray& ids) {
+        Utils::extract(fts, data.column(n), ids);
+    }
+};
+
+
+#endif // YARF_MAPPEDDATASET_HPP
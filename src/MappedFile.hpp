@@ -0,0 +1,127 @@
+/**
+ * Read only memory mapped files
+ */
+#ifndef YARF_MAPPEDFILE_HPP
+#define YARF_MAPPEDFILE_HPP
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "refcountptr.hpp"
+#include "Logger.hpp"
+
+
+/**
+ * A file mapped read only into memory. The pages are shared with any other
+ * process mapping the same file.
+ */
+class MappedFile
+{
+public:
+    typedef RefCountPtr<MappedFile> Ptr;
+
+    MappedFile():
+        m_data(NULL), m_size(0) {
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    /**
+     * Map a file, returns false on error
+     * file: The file name
+     */
+    bool open(const char file[]) {
+        close();
+
+        int fd = ::open(file, O_RDONLY);
+        if (fd < 0) {
+            LOG(Log::ERROR) << "Unable to open " << file << ": "
+                            << std::strerror(errno);
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            LOG(Log::ERROR) << "Unable to stat " << file << ": "
+                            << std::strerror(errno);
+            ::close(fd);
+            return false;
+        }
+
+        m_size = st.st_size;
+        if (m_size == 0) {
+            // mmap doesn't allow empty mappings
+            ::close(fd);
+            return true;
+        }
+
+        void* p = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            LOG(Log::ERROR) << "Unable to map " << file << ": "
+                            << std::strerror(errno);
+            m_size = 0;
+            return false;
+        }
+
+        m_data = static_cast<const char*>(p);
+        return true;
+    }
+
+    /**
+     * Unmap the file
+     */
+    void close() {
+        if (m_data) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+        m_data = NULL;
+        m_size = 0;
+    }
+
+    /**
+     * Hint that the file will be read sequentially
+     */
+    void adviseSequential() const {
+        if (m_data) {
+            madvise(const_cast<char*>(m_data), m_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    /**
+     * Pointer to the start of the file, page aligned, NULL if empty
+     */
+    const char* data() const {
+        return m_data;
+    }
+
+    /**
+     * Size of the file in bytes
+     */
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    // Not copyable
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    /**
+     * The mapped memory
+     */
+    const char* m_data;
+
+    /**
+     * Size of the mapping
+     */
+    size_t m_size;
+};
+
+
+#endif // YARF_MAPPEDFILE_HPP
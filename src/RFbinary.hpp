@@ -0,0 +1,861 @@
+/**
+ * A compact binary model format, and a prediction only forest which can be
+ * used directly from the binary data
+ */
+#ifndef YARF_RFBINARY_HPP
+#define YARF_RFBINARY_HPP
+
+#include <cstring>
+#include <istream>
+#include <iterator>
+#include <numeric>
+#include <ostream>
+#include "RFtypes.hpp"
+#include "RFtree.hpp"
+#include "RFflat.hpp"
+#include "RFleafpool.hpp"
+#include "MappedFile.hpp"
+#include "BlockCodec.hpp"
+#include "ThreadPool.hpp"
+#include "Logger.hpp"
+
+
+/**
+ * Memory holding the contents of a binary model
+ */
+class ModelStorage
+{
+public:
+    typedef RefCountPtr<ModelStorage> Ptr;
+
+    ModelStorage() {};
+
+    virtual ~ModelStorage() {};
+
+    /**
+     * Pointer to the data, aligned to at least 8 bytes
+     */
+    virtual const char* data() const = 0;
+
+    /**
+     * Size of the data in bytes
+     */
+    virtual size_t size() const = 0;
+};
+
+
+/**
+ * Model data held in an ordinary heap buffer
+ */
+class BufferStorage: public ModelStorage
+{
+public:
+    /**
+     * Create an uninitialised buffer
+     * size: Size in bytes
+     */
+    BufferStorage(size_t size):
+        m_buf((size + 7) / 8), m_size(size) {
+    }
+
+    /**
+     * Read the rest of a stream into a buffer, returns NULL on error
+     */
+    static BufferStorage* read(std::istream& is) {
+        std::string s((std::istreambuf_iterator<char>(is)),
+                      std::istreambuf_iterator<char>());
+        if (is.bad()) {
+            return NULL;
+        }
+        BufferStorage* b = new BufferStorage(s.size());
+        if (!s.empty()) {
+            std::memcpy(b->buffer(), s.data(), s.size());
+        }
+        return b;
+    }
+
+    virtual const char* data() const {
+        return m_buf.empty()? NULL:
+            reinterpret_cast<const char*>(&m_buf[0]);
+    }
+
+    virtual size_t size() const {
+        return m_size;
+    }
+
+    char* buffer() {
+        return m_buf.empty()? NULL: reinterpret_cast<char*>(&m_buf[0]);
+    }
+
+private:
+    /**
+     * The buffer, 8 byte words for alignment
+     */
+    std::vector<unsigned long long> m_buf;
+
+    /**
+     * Size in bytes
+     */
+    size_t m_size;
+};
+
+
+/**
+ * Model data in a memory mapped file
+ */
+class MappedStorage: public ModelStorage
+{
+public:
+    /**
+     * Map a file, returns NULL on error
+     */
+    static MappedStorage* open(const char file[]) {
+        MappedStorage* m = new MappedStorage;
+        if (!m->m_file.open(file)) {
+            delete m;
+            return NULL;
+        }
+        return m;
+    }
+
+    virtual const char* data() const {
+        return m_file.data();
+    }
+
+    virtual size_t size() const {
+        return m_file.size();
+    }
+
+private:
+    MappedStorage() {
+    }
+
+    /**
+     * The mapped file
+     */
+    MappedFile m_file;
+};
+
+
+/**
+ * A forest which can only be used for prediction, consisting of flattened
+ * trees and a leaf distribution pool. This is the in-memory form of the
+ * binary model format, which is:
+ *
+ * Header (64 bytes), all integers little-endian:
+ *   0  char[8] magic "YARFBIN"
+ *   8  u32 version
+ *   12 u32 flags, Compressed if any trees are compressed
+ *   16 u32 number of classes
+ *   20 u32 number of features (one more than the largest feature id used)
+ *   24 u32 number of trees
+ *   28 u32 number of pooled leaf distributions
+ *   32 u32 RFparameters::numTrees
+ *   36 u32 RFparameters::numSplitFeatures
+ *   40 f64 RFparameters::minScore
+ *   48 u64 offset of the leaf pool
+ *   56 u64 offset of the tree index
+ * Leaf pool: u16[leaves][classes] fixed point probabilities
+ * Tree index: for each tree {u64 offset, u64 size in bytes, u32 number of
+ *   nodes, u32 tree flags}
+ * Trees: for each tree the FlatNode records {f64 splitval, u32 ftid,
+ *   u32 far} followed by u32 training sample counts for each node. If the
+ *   ftid has the Categorical flag splitval holds a u64 category bitmap.
+ *
+ * Sections are aligned to 16 bytes. Split values are stored as the raw IEEE
+ * 754 bits so they are recovered exactly.
+ *
+ * If a tree has the TreeCompressed flag its records are byte plane shuffled
+ * (the nodes as 16 byte records, the counts as 4 byte records) and the
+ * result is compressed with BlockCodec. Each tree is compressed separately
+ * so trees can be decompressed in parallel. Version 1 files never contain
+ * compressed trees, categorical splits and the direction of missing
+ * values were added in version 3.
+ */
+class FlatForest
+{
+public:
+    typedef RefCountPtr<FlatForest> Ptr;
+
+    static const uint Version = 3;
+    static const uint HeaderSize = 64;
+    static const uint IndexEntrySize = 24;
+
+    /**
+     * Header flag set if any trees are compressed
+     */
+    static const uint Compressed = 1;
+
+    /**
+     * Tree index flag set if the tree is compressed
+     */
+    static const uint TreeCompressed = 1;
+
+    /**
+     * Create a prediction only copy of a finalised forest, returns NULL if
+     * a tree can't be flattened
+     */
+    static FlatForest* flatten(const RFforest& forest) {
+        FlatForest* f = new FlatForest(forest);
+        if (!f->flattenTrees(forest)) {
+            delete f;
+            return NULL;
+        }
+        return f;
+    }
+
+    /**
+     * Create a forest from binary model data, returns NULL if the data is
+     * invalid
+     * storage: The binary model, which is used directly and kept alive for
+     *          the life of the forest
+     * verify: If true check every node, otherwise only the header and tree
+     *         index are checked and the model must be trusted
+     */
+    static FlatForest* open(ModelStorage::Ptr storage, bool verify = true) {
+        FlatForest* f = new FlatForest(storage);
+        if (!f->parse(verify)) {
+            delete f;
+            return NULL;
+        }
+        return f;
+    }
+
+    /**
+     * Open a binary model file using a read only memory mapping, so that
+     * predictions read the file's pages directly. Nothing is copied and the
+     * pages are shared by all processes using the same model. Returns NULL
+     * on error.
+     * file: The binary model file
+     * verify: If false the nodes aren't checked, so that opening doesn't
+     *         touch every page of the model
+     */
+    static FlatForest* map(const char file[], bool verify = true) {
+        MappedStorage* m = MappedStorage::open(file);
+        if (!m) {
+            return NULL;
+        }
+        return open(m, verify);
+    }
+
+    /**
+     * Read a binary model from a stream, returns NULL on error
+     */
+    static FlatForest* read(std::istream& is) {
+        BufferStorage* b = BufferStorage::read(is);
+        if (!b) {
+            LOG(Log::ERROR) << "Failed to read binary model";
+            return NULL;
+        }
+        return open(b);
+    }
+
+    /**
+     * Check whether some data starts with the binary model magic number
+     */
+    static bool isBinary(const char* data, size_t size) {
+        return size >= MagicSize &&
+            std::memcmp(data, magic(), MagicSize) == 0;
+    }
+
+    /**
+     * Write the binary model
+     * compress: Compress the trees, trees which don't get smaller are
+     *           stored uncompressed
+     */
+    void write(std::ostream& os, bool compress = false) const {
+        size_t poolSize = size_t(m_numLeaves) * m_numClasses * 2;
+        size_t indexOffset = align(HeaderSize + poolSize);
+        size_t offset = align(indexOffset + numTrees() * IndexEntrySize);
+
+        // Compressed tree blocks, empty if the tree is stored uncompressed
+        std::vector<std::string> packed(numTrees());
+        uint flags = 0;
+        if (compress && nativeLayout()) {
+            for (uint t = 0; t < numTrees(); ++t) {
+                compressTree(t, packed[t]);
+                if (!packed[t].empty()) {
+                    flags |= Compressed;
+                }
+            }
+        }
+
+        Writer w(os);
+        w.bytes(magic(), MagicSize);
+        w.u32(Version);
+        w.u32(flags);
+        w.u32(m_numClasses);
+        w.u32(m_numFeatures);
+        w.u32(numTrees());
+        w.u32(m_numLeaves);
+        w.u32(m_params.numTrees);
+        w.u32(m_params.numSplitFeatures);
+        w.f64(m_params.minScore);
+        w.u64(HeaderSize);
+        w.u64(indexOffset);
+        assert(w.pos() == HeaderSize);
+
+        for (size_t i = 0; i < size_t(m_numLeaves) * m_numClasses; ++i) {
+            w.u16(m_pool[i]);
+        }
+        w.pad(indexOffset);
+
+        for (uint t = 0; t < numTrees(); ++t) {
+            size_t size = packed[t].empty()? treeBytes(t): packed[t].size();
+            w.u64(offset);
+            w.u64(size);
+            w.u32(m_trees[t].size);
+            w.u32(packed[t].empty()? 0: TreeCompressed);
+            offset = align(offset + size);
+        }
+
+        for (uint t = 0; t < numTrees(); ++t) {
+            w.pad(align(w.pos()));
+            if (!packed[t].empty()) {
+                w.bytes(packed[t].data(), packed[t].size());
+                continue;
+            }
+
+            const Tree& tree = m_trees[t];
+            for (uint i = 0; i < tree.size; ++i) {
+                // The raw bits, which may be a category bitmap
+                w.u64(tree.nodes[i].categories);
+                w.u32(tree.nodes[i].ftid);
+                w.u32(tree.nodes[i].far);
+            }
+            for (uint i = 0; i < tree.size; ++i) {
+                w.u32(tree.counts[i]);
+            }
+        }
+        w.pad(align(w.pos()));
+    }
+
+    /**
+     * Prediction into a caller owned array
+     * dist: Array of numClasses() values to hold the class predictions
+     * d: Sample to be predicted, anything with an operator[] returning the
+     *    value of a feature
+     */
+    template <typename SampleT>
+    void predict(double* dist, const SampleT& d) const {
+        std::fill(dist, dist + m_numClasses, 0);
+
+        for (uint t = 0; t < numTrees(); ++t) {
+            const LeafPool::Quantum* q =
+                leaf(flatFindLeaf(m_trees[t].nodes, d));
+            for (uint c = 0; c < m_numClasses; ++c) {
+                dist[c] += LeafPool::probability(q[c]);
+            }
+        }
+
+        double total = std::accumulate(dist, dist + m_numClasses, 0.0);
+        for (uint c = 0; c < m_numClasses; ++c) {
+            dist[c] /= total;
+        }
+    }
+
+    /**
+     * Prediction
+     * dist: Array to hold the class predictions
+     * d: Sample to be predicted
+     */
+    void predict(DoubleArray& dist, const DataSample& d) const {
+        dist.resize(m_numClasses);
+        predict(&dist[0], d);
+    }
+
+    uint numTrees() const {
+        return m_trees.size();
+    }
+
+    uint numClasses() const {
+        return m_numClasses;
+    }
+
+    /**
+     * Return the number of features required by the splits
+     */
+    uint numFeatures() const {
+        return m_numFeatures;
+    }
+
+    uint numLeaves() const {
+        return m_numLeaves;
+    }
+
+    const RFparameters& getParams() const {
+        return m_params;
+    }
+
+    /**
+     * Get the nodes of a tree
+     */
+    const FlatNode* nodes(uint t) const {
+        assert(t < numTrees());
+        return m_trees[t].nodes;
+    }
+
+    /**
+     * Get the number of nodes in a tree
+     */
+    uint numNodes(uint t) const {
+        assert(t < numTrees());
+        return m_trees[t].size;
+    }
+
+    /**
+     * Get the number of training samples at each node of a tree
+     */
+    const uint* nodeCounts(uint t) const {
+        assert(t < numTrees());
+        return m_trees[t].counts;
+    }
+
+    /**
+     * Get the fixed point class distribution of a leaf
+     * n: Leaf pool index
+     */
+    const LeafPool::Quantum* leaf(uint n) const {
+        assert(n < m_numLeaves);
+        return m_pool + size_t(n) * m_numClasses;
+    }
+
+protected:
+    /**
+     * Binary model magic number, including the terminating null
+     */
+    static const char* magic() {
+        return "YARFBIN";
+    }
+
+    static const uint MagicSize = 8;
+
+    /**
+     * A flattened tree
+     */
+    struct Tree
+    {
+        const FlatNode* nodes;
+        const uint* counts;
+        uint size;
+    };
+
+    /**
+     * Writes little-endian values to a stream
+     */
+    class Writer
+    {
+    public:
+        Writer(std::ostream& os):
+            m_os(os), m_pos(0) {
+        }
+
+        void bytes(const char* p, size_t n) {
+            m_os.write(p, n);
+            m_pos += n;
+        }
+
+        void u16(uint x) {
+            le(x, 2);
+        }
+
+        void u32(uint x) {
+            le(x, 4);
+        }
+
+        void u64(unsigned long long x) {
+            le(x, 8);
+        }
+
+        void f64(double x) {
+            unsigned long long u;
+            std::memcpy(&u, &x, sizeof(u));
+            le(u, 8);
+        }
+
+        /**
+         * Write zeros up to a position
+         */
+        void pad(size_t pos) {
+            assert(pos >= m_pos);
+            while (m_pos < pos) {
+                m_os.put(0);
+                ++m_pos;
+            }
+        }
+
+        size_t pos() const {
+            return m_pos;
+        }
+
+    private:
+        void le(unsigned long long x, uint n) {
+            char b[8];
+            for (uint i = 0; i < n; ++i) {
+                b[i] = char(x >> (8 * i));
+            }
+            bytes(b, n);
+        }
+
+        std::ostream& m_os;
+        size_t m_pos;
+    };
+
+    /**
+     * Read little-endian values
+     */
+    static unsigned long long le(const char* p, uint n) {
+        unsigned long long x = 0;
+        for (uint i = 0; i < n; ++i) {
+            x |= (unsigned long long)(unsigned char)(p[i]) << (8 * i);
+        }
+        return x;
+    }
+
+    static double f64(const char* p) {
+        unsigned long long u = le(p, 8);
+        double x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+
+    /**
+     * Round up to a multiple of the section alignment
+     */
+    static size_t align(size_t n) {
+        return (n + 15) & ~size_t(15);
+    }
+
+    /**
+     * Number of bytes used by a tree
+     */
+    size_t treeBytes(uint t) const {
+        return size_t(m_trees[t].size) * (sizeof(FlatNode) + sizeof(uint));
+    }
+
+    /**
+     * Shuffle and compress a tree, out is left empty if the tree doesn't get
+     * any smaller. Requires nativeLayout().
+     */
+    void compressTree(uint t, std::string& out) const {
+        const Tree& tree = m_trees[t];
+        size_t nodeBytes = size_t(tree.size) * sizeof(FlatNode);
+        std::vector<char> raw(treeBytes(t));
+
+        BlockCodec::shuffle(reinterpret_cast<const char*>(tree.nodes),
+                            &raw[0], tree.size, sizeof(FlatNode));
+        BlockCodec::shuffle(reinterpret_cast<const char*>(tree.counts),
+                            &raw[nodeBytes], tree.size, sizeof(uint));
+
+        out.clear();
+        BlockCodec::compress(&raw[0], raw.size(), out);
+        if (out.size() >= raw.size()) {
+            out.clear();
+        }
+    }
+
+    /**
+     * Decompress a tree into m_ownNodes and m_ownCounts, returns false if the
+     * compressed data is invalid
+     */
+    bool decompressTree(uint t, const char* data, size_t bytes) {
+        uint size = m_trees[t].size;
+        size_t nodeBytes = size_t(size) * sizeof(FlatNode);
+        std::vector<char> raw(treeBytes(t));
+
+        if (!BlockCodec::decompress(data, bytes, &raw[0], raw.size())) {
+            return false;
+        }
+
+        m_ownNodes[t].resize(size);
+        m_ownCounts[t].resize(size);
+        BlockCodec::unshuffle(&raw[0],
+                              reinterpret_cast<char*>(&m_ownNodes[t][0]),
+                              size, sizeof(FlatNode));
+        BlockCodec::unshuffle(&raw[nodeBytes],
+                              reinterpret_cast<char*>(&m_ownCounts[t][0]),
+                              size, sizeof(uint));
+        return true;
+    }
+
+    /**
+     * Decompresses one tree per work item
+     */
+    class DecompressTask: public ParallelTask
+    {
+    public:
+        /**
+         * trees: Indices of the compressed trees
+         * blocks: Offset and size of each compressed tree
+         * ok: Set to whether each tree was decompressed successfully
+         */
+        DecompressTask(FlatForest& forest, const UintArray& trees,
+                       const std::vector<std::pair<size_t, size_t> >& blocks,
+                       std::vector<char>& ok):
+            m_forest(forest), m_treeIds(trees), m_blocks(blocks), m_ok(ok) {
+        }
+
+        virtual void run(uint n, uint) {
+            const char* data = m_forest.m_storage->data();
+            m_ok[n] = m_forest.decompressTree(
+                m_treeIds[n], data + m_blocks[n].first, m_blocks[n].second);
+        }
+
+    private:
+        FlatForest& m_forest;
+        const UintArray& m_treeIds;
+        const std::vector<std::pair<size_t, size_t> >& m_blocks;
+        std::vector<char>& m_ok;
+    };
+
+    /**
+     * True if the records in the binary data can be used in place
+     */
+    static bool nativeLayout() {
+        FlatNode n;
+        n.splitval = 1;
+        n.ftid = 0x04030201u;
+        n.far = 0;
+        const char* p = reinterpret_cast<const char*>(&n);
+        return sizeof(FlatNode) == 16 && sizeof(uint) == 4 &&
+            sizeof(LeafPool::Quantum) == 2 && f64(p) == 1 &&
+            le(p + 8, 4) == n.ftid;
+    }
+
+    /**
+     * Parse and validate the binary model held in m_storage
+     * verify: Whether to check every node
+     */
+    bool parse(bool verify) {
+        const char* data = m_storage->data();
+        size_t size = m_storage->size();
+
+        if (!nativeLayout()) {
+            LOG(Log::ERROR) << "Binary models are not supported on this "
+                            << "platform";
+            return false;
+        }
+        if (size < HeaderSize || !data || !isBinary(data, size)) {
+            LOG(Log::ERROR) << "Not a binary model";
+            return false;
+        }
+        uint version = le(data + 8, 4);
+        uint flags = le(data + 12, 4);
+        if (version < 1 || version > Version) {
+            LOG(Log::ERROR) << "Unsupported binary model version " << version;
+            return false;
+        }
+        if ((flags & ~Compressed) || (version < 2 && flags)) {
+            LOG(Log::ERROR) << "Unsupported binary model flags " << flags;
+            return false;
+        }
+
+        m_numClasses = le(data + 16, 4);
+        m_numFeatures = le(data + 20, 4);
+        uint ntrees = le(data + 24, 4);
+        m_numLeaves = le(data + 28, 4);
+        m_params.numTrees = le(data + 32, 4);
+        m_params.numSplitFeatures = le(data + 36, 4);
+        m_params.minScore = f64(data + 40);
+        size_t poolOffset = le(data + 48, 8);
+        size_t indexOffset = le(data + 56, 8);
+
+        if (m_numClasses == 0 ||
+            !inside(poolOffset, size_t(m_numLeaves) * m_numClasses * 2, 2) ||
+            !inside(indexOffset, size_t(ntrees) * IndexEntrySize, 8)) {
+            return corrupt("header");
+        }
+        m_pool = reinterpret_cast<const LeafPool::Quantum*>(data + poolOffset);
+
+        // Compressed trees and their offsets and sizes
+        UintArray packed;
+        std::vector<std::pair<size_t, size_t> > blocks;
+
+        m_trees.resize(ntrees);
+        for (uint t = 0; t < ntrees; ++t) {
+            const char* e = data + indexOffset + t * IndexEntrySize;
+            size_t offset = le(e, 8);
+            size_t bytes = le(e + 8, 8);
+            Tree& tree = m_trees[t];
+            tree.size = le(e + 16, 4);
+            uint treeFlags = version < 2? 0: le(e + 20, 4);
+
+            if (treeFlags == TreeCompressed && (flags & Compressed)) {
+                if (tree.size == 0 || !inside(offset, bytes, 1)) {
+                    return corrupt("tree index");
+                }
+                packed.push_back(t);
+                blocks.push_back(std::make_pair(offset, bytes));
+                continue;
+            }
+
+            if (treeFlags != 0 || tree.size == 0 || bytes != treeBytes(t) ||
+                !inside(offset, bytes, 8)) {
+                return corrupt("tree index");
+            }
+            tree.nodes = reinterpret_cast<const FlatNode*>(data + offset);
+            tree.counts = reinterpret_cast<const uint*>(
+                data + offset + size_t(tree.size) * sizeof(FlatNode));
+
+            if (verify && !validTree(tree)) {
+                return corrupt("tree");
+            }
+        }
+
+        if (!packed.empty()) {
+            m_ownNodes.resize(ntrees);
+            m_ownCounts.resize(ntrees);
+            std::vector<char> ok(packed.size());
+
+            ThreadPool pool(std::min<uint>(packed.size(),
+                                           ThreadPool::hardwareThreads()));
+            DecompressTask task(*this, packed, blocks, ok);
+            pool.run(task, packed.size());
+
+            for (uint i = 0; i < packed.size(); ++i) {
+                Tree& tree = m_trees[packed[i]];
+                if (!ok[i]) {
+                    return corrupt("compressed tree");
+                }
+                tree.nodes = &m_ownNodes[packed[i]][0];
+                tree.counts = &m_ownCounts[packed[i]][0];
+
+                if (verify && !validTree(tree)) {
+                    return corrupt("tree");
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Check that every path through a tree terminates at a valid leaf
+     */
+    bool validTree(const Tree& tree) const {
+        for (uint i = 0; i < tree.size; ++i) {
+            const FlatNode& n = tree.nodes[i];
+            if (n.isLeaf()) {
+                if (n.far >= m_numLeaves) {
+                    return false;
+                }
+            }
+            else if (n.feature() >= m_numFeatures || i + 1 >= tree.size ||
+                     n.far <= i || n.far >= tree.size ||
+                     (n.ftid & ~(FlatNode::FeatureMask | FlatNode::NearRight |
+                                 FlatNode::Categorical |
+                                 FlatNode::MissingRight))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Check that a section lies within the data and is aligned
+     */
+    bool inside(size_t offset, size_t bytes, size_t alignment) const {
+        size_t size = m_storage->size();
+        return offset % alignment == 0 && offset <= size &&
+            bytes <= size - offset;
+    }
+
+    bool corrupt(const char* what) const {
+        LOG(Log::ERROR) << "Corrupt binary model: invalid " << what;
+        return false;
+    }
+
+private:
+    /**
+     * Constructor for a copy of a forest, call flattenTrees() to copy the
+     * trees
+     */
+    FlatForest(const RFforest& forest):
+        m_numClasses(forest.numClasses()), m_numFeatures(0),
+        m_params(*forest.getParams()), m_numLeaves(0), m_pool(NULL) {
+    }
+
+    /**
+     * Copy the leaf pool and flatten the trees of a forest, returns false if
+     * a tree can't be flattened
+     */
+    bool flattenTrees(const RFforest& forest) {
+        const LeafPool& pool = *forest.getLeafPool();
+        m_numLeaves = pool.size();
+        if (m_numLeaves > 0) {
+            m_ownPool.assign(pool.entry(0),
+                             pool.entry(0) + m_numLeaves * m_numClasses);
+        }
+        m_pool = m_ownPool.empty()? NULL: &m_ownPool[0];
+
+        m_ownNodes.resize(forest.numTrees());
+        m_ownCounts.resize(forest.numTrees());
+        m_trees.resize(forest.numTrees());
+
+        for (uint t = 0; t < forest.numTrees(); ++t) {
+            if (!TreeFlattener::flatten(
+                    m_ownNodes[t], *forest.getTree(t)->getRoot(),
+                    &m_ownCounts[t])) {
+                LOG(Log::ERROR) << "Tree " << t << " can't be flattened";
+                return false;
+            }
+
+            m_trees[t].nodes = m_ownNodes[t].empty()? NULL:
+                &m_ownNodes[t][0];
+            m_trees[t].counts = m_ownCounts[t].empty()? NULL:
+                &m_ownCounts[t][0];
+            m_trees[t].size = m_ownNodes[t].size();
+
+            for (uint i = 0; i < m_trees[t].size; ++i) {
+                const FlatNode& n = m_trees[t].nodes[i];
+                if (!n.isLeaf() && n.feature() >= m_numFeatures) {
+                    m_numFeatures = n.feature() + 1;
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Constructor for binary data
+     */
+    FlatForest(ModelStorage::Ptr storage):
+        m_numClasses(0), m_numFeatures(0), m_numLeaves(0), m_pool(NULL),
+        m_storage(storage) {
+    }
+
+    uint m_numClasses;
+    uint m_numFeatures;
+    RFparameters m_params;
+
+    /**
+     * Number of pooled leaf distributions
+     */
+    uint m_numLeaves;
+
+    /**
+     * Pooled leaf distributions, m_pool[n * m_numClasses + c]
+     */
+    const LeafPool::Quantum* m_pool;
+
+    /**
+     * The trees
+     */
+    std::vector<Tree> m_trees;
+
+    /**
+     * Binary model data referenced by m_pool and m_trees, if any
+     */
+    ModelStorage::Ptr m_storage;
+
+    /**
+     * Storage for a forest created from an RFforest, or for decompressed
+     * trees
+     */
+    std::vector<LeafPool::Quantum> m_ownPool;
+    std::vector<FlatNodeArray> m_ownNodes;
+    std::vector<UintArray> m_ownCounts;
+};
+
+
+#endif // YARF_RFBINARY_HPP
@@ -4,6 +4,9 @@
 #ifndef YARF_RFDESERIALISE_HPP
 #define YARF_RFDESERIALISE_HPP
 
+#include <cctype>
+#include <cstring>
+#include <fstream>
 #include <sstream>
 #include "RFtypes.hpp"
 #include "DataIO.hpp"
@@ -11,9 +14,59 @@
 #include "RFnode.hpp"
 #include "RFtree.hpp"
 #include "RFsplit.hpp"
+#include "RFbinary.hpp"
+#include "MappedFile.hpp"
 
 
 
+/**
+ * A reference to characters owned by something else
+ */
+struct StrRef
+{
+    StrRef():
+        p(""), n(0) {
+    }
+
+    StrRef(const char* p, size_t n):
+        p(p), n(n) {
+    }
+
+    bool operator==(const char* s) const {
+        return std::strncmp(p, s, n) == 0 && s[n] == '\0';
+    }
+
+    bool operator!=(const char* s) const {
+        return !(*this == s);
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    const char* begin() const {
+        return p;
+    }
+
+    const char* end() const {
+        return p + n;
+    }
+
+    std::string str() const {
+        return std::string(p, n);
+    }
+
+    const char* p;
+    size_t n;
+};
+
+
+/**
+ * Splits serialised objects into tokens. The input is scanned in place,
+ * either from a memory range or from a buffer filled from a stream in large
+ * blocks, so no memory is allocated per token. The strings in a token refer
+ * to the input and are only valid until the next call to next().
+ */
 class Deserialiser
 {
 public:
@@ -31,10 +84,10 @@ public:
     struct Token
     {
         Type type;
-        std::string tag;
+        StrRef tag;
         uint n;
-        std::string value;
-        std::string object;
+        StrRef value;
+        StrRef object;
     };
 
     static std::string toString(const Token& t) {
@@ -69,43 +122,59 @@ public:
         }
 
         oss << " : "
-            << t.tag << " : "
+            << t.tag.str() << " : "
             << t.n << " : "
-            << t.value << " : "
-            << t.object;
+            << t.value.str().substr(0, 80) << " : "
+            << t.object.str();
 
         return oss.str();
     }
 
+    /**
+     * Read from a stream, which is read ahead in blocks
+     */
     Deserialiser(std::istream& is):
-        m_is(is), m_count(0) {
+        m_is(&is), m_data(NULL), m_size(0), m_pos(0), m_count(0) {
+    }
+
+    /**
+     * Read from memory, which must remain in scope for the life of the
+     * deserialiser
+     * begin: The first character
+     * end: One past the last character
+     */
+    Deserialiser(const char* begin, const char* end):
+        m_is(NULL), m_data(begin), m_size(end - begin), m_pos(0),
+        m_count(0) {
     }
 
     const Token& next() {
+        discard();
         resetToken(m_tok);
-        std::string s = read();
-        if (s.empty()) {
+
+        Word s;
+        if (!read(s)) {
             // Error or EOF
             return m_tok;
         }
 
+        Word tag;
         if (isTagName(s)) {
-            m_tok.tag = s;
-            s = read();
-
-            if (s.empty()) {
+            tag = s;
+            if (!read(s)) {
                 // Error or EOF
                 return m_tok;
             }
         }
 
+        Word value, object;
         if (isObjectStart(s)) {
             m_tok.type = ObjectStart;
-            m_tok.object = parseObjectStart(s);
+            object = Word(s.pos, s.len - 1);
         }
         else if (isObjectEnd(s)) {
             m_tok.type = ObjectEnd;
-            m_tok.object = parseObjectEnd(s);
+            object = Word(s.pos + 1, s.len - 1);
         }
         else if (isArraySize(s)) {
             m_tok.n = parseArraySize(s);
@@ -113,131 +182,287 @@ public:
                 m_tok.type = EmptyArray;
             }
             else {
-                s = read();
+                size_t pos = m_pos;
+                if (!read(s)) {
+                    return m_tok;
+                }
                 if (isObjectStart(s)) {
                     m_tok.type = ObjectArray;
-                    unread(s);
+                    // Unread
+                    m_pos = pos;
+                    --m_count;
                 }
                 else if (isNumericArray(s)) {
                     m_tok.type = NumericArray;
-                    m_tok.value = s;
+                    value = s;
                 }
                 else {
                     fail("Unknown array type", s);
+                    return m_tok;
                 }
             }
         }
         else {
             m_tok.type = Scalar;
-            m_tok.value = s;
+            value = s;
         }
 
+        // The buffer may have moved while reading, so only refer to it once
+        // the whole token has been read
+        m_tok.tag = ref(tag);
+        m_tok.value = ref(value);
+        m_tok.object = ref(object);
         return m_tok;
     }
 
+    /**
+     * Parse a number at the start of a range
+     * Returns a pointer to the first character after the number, or NULL if
+     * there isn't one
+     */
+    static const char* parse(const char* p, const char* end, double& x) {
+        char buf[64];
+        size_t n = std::min<size_t>(
+            std::find(p, end, ',') - p, sizeof(buf) - 1);
+        std::memcpy(buf, p, n);
+        buf[n] = '\0';
+
+        char* q;
+        x = std::strtod(buf, &q);
+        return q == buf? NULL: p + (q - buf);
+    }
+
+    static const char* parse(const char* p, const char* end, int& x) {
+        bool neg = p < end && *p == '-';
+        unsigned long long u;
+        p = parseUnsigned(neg? p + 1: p, end, u);
+        x = neg? -int(u): int(u);
+        return p;
+    }
+
+    static const char* parse(const char* p, const char* end, bool& x) {
+        unsigned long long u;
+        p = parseUnsigned(p, end, u);
+        x = u != 0;
+        return p;
+    }
+
+    template <typename T>
+    static const char* parse(const char* p, const char* end, T& x) {
+        unsigned long long u;
+        p = parseUnsigned(p, end, u);
+        x = T(u);
+        return p;
+    }
+
 protected:
-    bool isTagName(std::string s) {
-        return isAlpha(s);
+    /**
+     * A word in the input, as an offset since the buffer may move
+     */
+    struct Word
+    {
+        Word():
+            pos(0), len(0) {
+        }
+
+        Word(size_t pos, size_t len):
+            pos(pos), len(len) {
+        }
+
+        size_t pos;
+        size_t len;
+    };
+
+    static const size_t BlockSize = 1 << 16;
+
+    static const char* parseUnsigned(const char* p, const char* end,
+                                     unsigned long long& x) {
+        const char* start = p;
+        x = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            x = x * 10 + (*p++ - '0');
+        }
+        return p == start? NULL: p;
     }
 
-    bool isObjectStart(std::string s) {
-        return (s[s.size() - 1] == '{') && isAlpha(s.substr(0, s.size() - 1));
+    StrRef ref(const Word& w) const {
+        return w.len == 0? StrRef(): StrRef(m_data + w.pos, w.len);
     }
 
-    std::string parseObjectStart(std::string s) {
-        return s.substr(0, s.size() - 1);
+    char at(const Word& w, size_t i) const {
+        return m_data[w.pos + i];
     }
 
-    bool isObjectEnd(std::string s) {
-        return (s[0] == '}') && isAlpha(s.substr(1, s.size() - 1));
+    bool isTagName(const Word& s) const {
+        return isAlpha(s.pos, s.len);
     }
 
-    std::string parseObjectEnd(std::string s) {
-        return s.substr(1, s.size() - 1);
+    bool isObjectStart(const Word& s) const {
+        return at(s, s.len - 1) == '{' && isAlpha(s.pos, s.len - 1);
     }
 
-    bool isArraySize(std::string s) {
-        return (s.size() >= 3) && (s[0] == '[') && (s[s.size() - 1] == ']') &&
-            isUint(s.substr(1, s.size() - 2));
+    bool isObjectEnd(const Word& s) const {
+        return at(s, 0) == '}' && isAlpha(s.pos + 1, s.len - 1);
     }
 
-    uint parseArraySize(std::string s) {
-        return Tokeniser::convert<uint>(s.substr(1, s.size() - 2));
+    bool isArraySize(const Word& s) const {
+        if (s.len < 3 || at(s, 0) != '[' || at(s, s.len - 1) != ']') {
+            return false;
+        }
+        for (size_t i = 1; i < s.len - 1; ++i) {
+            if (at(s, i) < '0' || at(s, i) > '9') {
+                return false;
+            }
+        }
+        return true;
     }
 
-    bool isAlpha(std::string s) {
-        return s.find_first_not_of(
-            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-            "abcdefghijklmnopqrstuvwxyz"
-            ) == std::string::npos;
+    uint parseArraySize(const Word& s) const {
+        uint n;
+        parse(m_data + s.pos + 1, m_data + s.pos + s.len - 1, n);
+        return n;
     }
 
-    bool isNumericArray(std::string s) {
-        return s.find_first_not_of(
-            "0123456789"
-            ".-e,"
-            ) == std::string::npos;
+    bool isAlpha(size_t pos, size_t len) const {
+        for (const char* p = m_data + pos; p < m_data + pos + len; ++p) {
+            if (!((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    bool isUint(std::string s) {
-        return s.find_first_not_of(
-            "0123456789"
-            ) == std::string::npos;
+    bool isNumericArray(const Word& s) const {
+        for (size_t i = 0; i < s.len; ++i) {
+            char c = at(s, i);
+            if (!((c >= '0' && c <= '9') || c == '.' || c == '-' ||
+                  c == 'e' || c == ',')) {
+                return false;
+            }
+        }
+        return true;
     }
 
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' ||
+            c == '\v' || c == '\f';
+    }
 
     void resetToken(Token& tok) const {
         tok.type = ParseError;
-        tok.tag = "";
+        tok.tag = StrRef();
         tok.n = 0;
-        tok.value = "";
-        tok.object = "";
+        tok.value = StrRef();
+        tok.object = StrRef();
     }
 
-    void fail(std::string msg, std::string tok = "") {
+    void fail(std::string msg, const Word& w = Word()) {
         resetToken(m_tok);
-        m_tok.tag = "ERROR near token number " +
+        m_message = "ERROR near token number " +
             Tokeniser::toString(m_count) +
             " : " + msg +
-            " :\"" + tok + "\"";
+            " :\"" + std::string(m_data + w.pos, w.len) + "\"";
+        m_tok.tag = StrRef(m_message.data(), m_message.size());
     }
 
-    std::string read() {
-        std::string s;
-
-        if (!m_last.empty()) {
-            s = m_last;
-            m_last = "";
-            return s;
+    /**
+     * Read a whitespace delimited word, returns false on error or EOF
+     */
+    bool read(Word& w) {
+        while (true) {
+            while (m_pos < m_size && isSpace(m_data[m_pos])) {
+                ++m_pos;
+            }
+            if (m_pos < m_size) {
+                break;
+            }
+            if (!fill()) {
+                if (m_is && m_is->bad()) {
+                    fail("Read failed");
+                }
+                else {
+                    resetToken(m_tok);
+                    m_message = "EOF after " + Tokeniser::toString(m_count) +
+                        "tokens";
+                    m_tok.tag = StrRef(m_message.data(), m_message.size());
+                    m_tok.type = ParseEof;
+                }
+                return false;
+            }
         }
 
-        m_is >> s;
-        if (!m_is) {
-            if(m_is.eof()) {
-                resetToken(m_tok);
-                m_tok.tag = "EOF after " + Tokeniser::toString(m_count) +
-                    "tokens";
-                m_tok.type = ParseEof;
-                return "";
+        w.pos = m_pos;
+        while (true) {
+            while (m_pos < m_size && !isSpace(m_data[m_pos])) {
+                ++m_pos;
+            }
+            if (m_pos < m_size || !fill()) {
+                break;
             }
-            fail("Read failed");
         }
+        w.len = m_pos - w.pos;
 
         ++m_count;
-        //assert(!s.empty());
+        return true;
+    }
+
+    /**
+     * Read another block from the stream, returns false if nothing was read
+     */
+    bool fill() {
+        if (!m_is || !*m_is) {
+            return false;
+        }
 
-        return s;
+        m_buf.resize(m_size + BlockSize);
+        m_is->read(&m_buf[m_size], BlockSize);
+        size_t n = m_is->gcount();
+        m_size += n;
+        m_buf.resize(m_size);
+        m_data = m_buf.empty()? NULL: &m_buf[0];
+        return n > 0;
     }
 
-    void unread(std::string s) {
-        assert(m_last.empty());
-        m_last = s;
+    /**
+     * Drop stream data which has already been parsed
+     */
+    void discard() {
+        if (m_is && m_pos > BlockSize) {
+            m_buf.erase(m_buf.begin(), m_buf.begin() + m_pos);
+            m_size -= m_pos;
+            m_pos = 0;
+            m_data = m_buf.empty()? NULL: &m_buf[0];
+        }
     }
 
-    std::istream& m_is;
+    /**
+     * The stream, NULL if reading from memory
+     */
+    std::istream* m_is;
+
+    /**
+     * Buffer holding data read from the stream
+     */
+    std::vector<char> m_buf;
+
+    /**
+     * The input, and the number of characters available
+     */
+    const char* m_data;
+    size_t m_size;
+
+    /**
+     * Current position in m_data
+     */
+    size_t m_pos;
+
     uint m_count;
     Token m_tok;
-    std::string m_last;
+
+    /**
+     * Holds error messages referred to by m_tok
+     */
+    std::string m_message;
 };
 
 
@@ -254,10 +479,31 @@ public:
         m_deserialiser(deserialiser) {
     }
 
-    RFforest* dRFforest() {
-        return dRFforest(nextToken());
+    /**
+     * Read a forest
+     * finalise: If false the forest isn't finalised, the caller must call
+     *           RFforest::finalise() once the trees are final
+     */
+    RFforest* dRFforest(bool finalise = true) {
+        return dRFforest(nextToken(), finalise);
     }
 
+    /**
+     * Open a serialised forest. If it was saved by
+     * RFforest::serialiseIndexed() each tree is only parsed when it's first
+     * used, otherwise the whole forest is parsed.
+     * fname: The serialised forest
+     * subset: If not NULL the indices of the trees to be included, in the
+     *         order they should appear in the forest
+     * lazy: If false all the trees are loaded immediately
+     * nthreads: Number of threads used to load the trees if lazy is false
+     *           and the forest has an index, 0 to use all processors
+     * Returns NULL on error
+     */
+    static RFforest* openForest(const char fname[],
+                                const UintArray* subset = NULL,
+                                bool lazy = true, uint nthreads = 1);
+
     D::Token nextToken() {
         return next();
     }
@@ -292,7 +538,7 @@ public:
         return obj;
     }
 
-    RFforest* dRFforest(D::Token t) {
+    RFforest* dRFforest(D::Token t, bool finalise = true) {
         check(t.type == D::ObjectStart && t.object == "RFforest");
         RFforest* obj = new RFforest();
 
@@ -313,6 +559,9 @@ public:
                 }
             }
             else if (t.type == D::ObjectEnd && t.object == "RFforest") {
+                if (finalise) {
+                    obj->finalise();
+                }
                 break;
             }
             else {
@@ -326,6 +575,35 @@ public:
         return obj;
     }
 
+    /**
+     * Read the forest parameters, stopping at the start of the trees
+     * Returns the number of trees
+     */
+    uint dRFforestHeader(RFforest* obj, D::Token t) {
+        check(t.type == D::ObjectStart && t.object == "RFforest");
+
+        while (true) {
+            t = next();
+
+            if (t.tag == "data" && t.type == D::EmptyArray) {
+                obj->m_data = NULL;
+            }
+            else if (t.tag == "params" && t.type == D::ObjectStart) {
+                obj->m_params = dRFparameters(t);
+            }
+            else if(t.tag == "trees" && t.type == D::ObjectArray) {
+                return t.n;
+            }
+            else {
+                // error
+                LOG(Log::ERROR) << "Unexpected token: "
+                                << Deserialiser::toString(t);
+                assert(false);
+                return 0;
+            }
+        }
+    }
+
     RFtree* dRFtree(D::Token t) {
         check(t.type == D::ObjectStart && t.object == "RFtree");
         RFtree* obj = new RFtree();
@@ -343,12 +621,24 @@ public:
             else if(t.tag == "ids" && t.type == D::NumericArray) {
                 set(obj->m_ids, t.value);
             }
+            else if(t.tag == "ids" && t.type == D::EmptyArray) {
+                obj->m_ids.clear();
+            }
             else if(t.tag == "bag" && t.type == D::NumericArray) {
                 set(obj->m_bag, t.value);
             }
+            else if(t.tag == "bag" && t.type == D::EmptyArray) {
+                obj->m_bag.clear();
+            }
             else if(t.tag == "oob" && t.type == D::NumericArray) {
                 set(obj->m_oob, t.value);
             }
+            else if(t.tag == "oob" && t.type == D::EmptyArray) {
+                obj->m_oob.clear();
+            }
+            else if(t.tag == "oobBits" && t.type == D::Scalar) {
+                check(bitmapToIds(obj->m_oob, t.value));
+            }
             else if (t.tag == "root" && t.type == D::ObjectStart) {
                 obj->m_root = dRFnode(t);
             }
@@ -484,6 +774,19 @@ public:
             else if (t.tag == "splitval" && t.type == D::Scalar) {
                 set(obj->m_splitval, t.value);
             }
+            else if (t.tag == "categories" && t.type == D::Scalar) {
+                set(obj->m_categories, t.value);
+                obj->m_categorical = true;
+            }
+            else if (t.tag == "missingRight" && t.type == D::Scalar) {
+                set(obj->m_missingRight, t.value);
+            }
+            else if (t.tag == "zeros" && t.type == D::Scalar) {
+                set(obj->m_numZeros, t.value);
+            }
+            else if (t.tag == "zeropos" && t.type == D::Scalar) {
+                set(obj->m_zeroPos, t.value);
+            }
             else if (t.type == D::ObjectEnd &&
                      t.object == "MaxInfoGainSingleSplit") {
                 break;
@@ -499,20 +802,264 @@ public:
         return obj;
     }
 
+    /**
+     * Reconstruct a forest from a prediction only forest. Leaf class counts
+     * are recovered from the quantised distributions and sample counts, so
+     * are exact for leaves with fewer than 65535 samples. Sample ids and
+     * out of bag samples are not available.
+     */
+    RFforest* dRFforest(const FlatForest& flat) {
+        RFforest* obj = new RFforest();
+        obj->m_data = NULL;
+        obj->m_params = new RFparameters(flat.getParams());
+
+        obj->m_trees.resize(flat.numTrees());
+        for (uint n = 0; n < flat.numTrees(); ++n) {
+            RFtree* tree = new RFtree();
+            tree->m_data = NULL;
+            tree->m_params = obj->m_params;
+            tree->m_root = dRFnode(flat, n, 0, 0);
+            obj->m_trees[n] = tree;
+        }
+
+        obj->finalise();
+        return obj;
+    }
+
+    RFnode* dRFnode(const FlatForest& flat, uint tree, uint i, uint depth) {
+        const FlatNode& f = flat.nodes(tree)[i];
+        RFnode* obj = new RFnode();
+        obj->m_n = flat.nodeCounts(tree)[i];
+        obj->m_depth = depth;
+
+        MaxInfoGainSplit* split = new MaxInfoGainSplit();
+        obj->m_split = split;
+
+        if (f.isLeaf()) {
+            const LeafPool::Quantum* q = flat.leaf(f.far);
+            obj->m_counts.resize(flat.numClasses());
+            for (uint c = 0; c < flat.numClasses(); ++c) {
+                obj->m_counts[c] = std::floor(
+                    LeafPool::probability(q[c]) * obj->m_n + 0.5);
+            }
+
+            split->m_gotSplit = false;
+            split->m_bestft = -1;
+        }
+        else {
+            bool nearRight = f.ftid & FlatNode::NearRight;
+            obj->m_left = dRFnode(flat, tree, nearRight? f.far: i + 1,
+                                  depth + 1);
+            obj->m_right = dRFnode(flat, tree, nearRight? i + 1: f.far,
+                                   depth + 1);
+
+            obj->m_counts = obj->m_left->m_counts;
+            std::transform(obj->m_counts.begin(), obj->m_counts.end(),
+                           obj->m_right->m_counts.begin(),
+                           obj->m_counts.begin(), std::plus<double>());
+
+            MaxInfoGainSingleSplit* s = new MaxInfoGainSingleSplit();
+            s->m_ftid = f.feature();
+            if (f.ftid & FlatNode::Categorical) {
+                s->m_categorical = true;
+                s->m_categories = f.categories;
+                s->m_splitval = 0;
+            }
+            else {
+                s->m_splitval = f.splitval;
+                s->m_missingRight = f.ftid & FlatNode::MissingRight;
+            }
+            s->m_counts = obj->m_counts;
+
+            split->m_gotSplit = true;
+            split->m_bestft = 0;
+            split->m_splits.push_back(s);
+        }
+        split->m_counts = obj->m_counts;
+
+        return obj;
+    }
+
 protected:
+    /**
+     * Read the tree index written by RFforest::serialiseIndexed()
+     * is: The serialised forest
+     * ncls: Set to the number of classes
+     * offsets: Array to hold the tree offsets
+     * indexOffset: Set to the offset of the index, which follows the trees
+     * Returns false if there is no index
+     */
+    static bool readIndex(std::istream& is, uint& ncls, OffsetArray& offsets,
+                          unsigned long long& indexOffset) {
+        const char* footerTag = "indexOffset ";
+        char footer[RFforest::IndexFooterSize + 1];
+
+        is.seekg(0, std::ios::end);
+        std::streamoff size = is.tellg();
+        if (!is || size < std::streamoff(RFforest::IndexFooterSize)) {
+            return false;
+        }
+        is.seekg(size - RFforest::IndexFooterSize);
+        is.read(footer, RFforest::IndexFooterSize);
+        footer[RFforest::IndexFooterSize] = '\0';
+        if (!is || std::strncmp(footer, footerTag, std::strlen(footerTag))) {
+            return false;
+        }
+
+        unsigned long long offset;
+        if (!D::parse(footer + std::strlen(footerTag),
+                      footer + RFforest::IndexFooterSize, offset)) {
+            return false;
+        }
+        indexOffset = offset;
+        is.seekg(offset);
+        Deserialiser ds(is);
+        D::Token t = ds.next();
+        if (t.type != D::ObjectStart || t.object != "RFindex") {
+            return false;
+        }
+
+        offsets.clear();
+        while (true) {
+            t = ds.next();
+
+            if (t.tag == "numClasses" && t.type == D::Scalar) {
+                set(ncls, t.value);
+            }
+            else if (t.tag == "trees" && t.type == D::NumericArray) {
+                set(offsets, t.value);
+            }
+            else if (t.type == D::ObjectEnd && t.object == "RFindex") {
+                return !offsets.empty();
+            }
+            else {
+                LOG(Log::ERROR) << "Invalid tree index: "
+                                << Deserialiser::toString(t);
+                return false;
+            }
+        }
+    }
+
+    /**
+     * Check that each tree index entry points at a whole tree, so that a
+     * truncated file or an index which doesn't match the trees is rejected
+     * when the forest is opened instead of when a tree is first used. Only
+     * the start and end of each tree are read.
+     * file: The serialised forest
+     * offsets: The tree offsets from the index
+     * indexOffset: The offset of the index
+     * Returns false if an entry is invalid
+     */
+    static bool checkIndex(const MappedFile& file, const OffsetArray& offsets,
+                           unsigned long long indexOffset) {
+        if (indexOffset > file.size()) {
+            return false;
+        }
+
+        const char* data = file.data();
+        for (uint n = 0; n < offsets.size(); ++n) {
+            unsigned long long end = n + 1 < offsets.size()?
+                offsets[n + 1]: indexOffset;
+            if (offsets[n] >= end || end > indexOffset) {
+                return false;
+            }
+
+            StrRef tree(data + offsets[n], end - offsets[n]);
+            trim(tree);
+            if (n + 1 == offsets.size() && !removeSuffix(tree, "}RFforest")) {
+                return false;
+            }
+            trim(tree);
+            if (!hasPrefix(tree, "RFtree{") || !removeSuffix(tree, "}RFtree")) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Remove leading and trailing whitespace
+     */
+    static void trim(StrRef& s) {
+        while (s.n > 0 && std::isspace((unsigned char)s.p[0])) {
+            ++s.p;
+            --s.n;
+        }
+        while (s.n > 0 && std::isspace((unsigned char)s.p[s.n - 1])) {
+            --s.n;
+        }
+    }
+
+    static bool hasPrefix(const StrRef& s, const char* prefix) {
+        size_t n = std::strlen(prefix);
+        return s.n >= n && std::memcmp(s.p, prefix, n) == 0;
+    }
+
+    /**
+     * Remove a suffix, returns false if s doesn't end with it
+     */
+    static bool removeSuffix(StrRef& s, const char* suffix) {
+        size_t n = std::strlen(suffix);
+        if (s.n < n || std::memcmp(s.p + s.n - n, suffix, n) != 0) {
+            return false;
+        }
+        s.n -= n;
+        return true;
+    }
+
+    /**
+     * Decode a bitmap written by idsToBitmap(), returns false if it's invalid
+     */
+    static bool bitmapToIds(IdArray& ids, const StrRef& s) {
+        ids.clear();
+        if (s.n < 2 || s.p[0] != '0' || s.p[1] != 'x') {
+            return false;
+        }
+
+        for (uint i = 2; i < s.n; ++i) {
+            const char* digits = "0123456789abcdef";
+            const char* p = std::strchr(digits, s.p[i]);
+            if (!p || !*p) {
+                return false;
+            }
+            uint x = p - digits;
+            for (uint b = 0; b < 4; ++b) {
+                if (x & (1 << b)) {
+                    ids.push_back((i - 2) * 4 + b);
+                }
+            }
+        }
+        return true;
+    }
+
     template <typename T>
-    static void set(T& x, const std::string s) {
-        x = Utils::convert<T>(s);
+    static void set(T& x, const StrRef& s) {
+        check(D::parse(s.begin(), s.end(), x) == s.end());
     }
 
+    /**
+     * Parse a comma separated array directly into a vector
+     */
     template <typename T>
-    static void set(std::vector<T>& xs, std::string s) {
+    static void set(std::vector<T>& xs, const StrRef& s) {
         xs.clear();
-        Tokeniser tok(",", false);
-        tok.set(s);
+        xs.reserve(std::count(s.begin(), s.end(), ',') + 1);
 
-        while (tok.hasNext()) {
-            xs.push_back(Utils::convert<T>(tok.next()));
+        const char* p = s.begin();
+        while (true) {
+            T x;
+            p = D::parse(p, s.end(), x);
+            check(p != NULL);
+            if (!p) {
+                return;
+            }
+            xs.push_back(x);
+
+            if (p == s.end()) {
+                return;
+            }
+            check(*p == ',');
+            ++p;
         }
     }
 
@@ -533,9 +1080,143 @@ protected:
     }
 
 private:
-    Deserialiser m_deserialiser;
+    Deserialiser& m_deserialiser;
+};
+
+
+/**
+ * Loads trees from a memory mapped file using the offsets in its tree index.
+ * Trees can be loaded concurrently.
+ */
+class IndexedTreeLoader: public TreeLoader
+{
+public:
+    /**
+     * file: The serialised forest
+     * offsets: The offset of each tree to be loaded, in forest order
+     */
+    IndexedTreeLoader(MappedFile::Ptr file, const OffsetArray& offsets):
+        m_file(file), m_offsets(offsets) {
+    }
+
+    virtual RFtree* load(uint n) {
+        assert(n < m_offsets.size());
+        if (m_offsets[n] >= m_file->size()) {
+            return NULL;
+        }
+
+        const char* data = m_file->data();
+        Deserialiser ds(data + m_offsets[n], data + m_file->size());
+        RFbuilder builder(ds);
+        Deserialiser::Token t = builder.nextToken();
+        if (t.type != Deserialiser::ObjectStart || t.object != "RFtree") {
+            return NULL;
+        }
+        return builder.dRFtree(t);
+    }
+
+private:
+    MappedFile::Ptr m_file;
+    OffsetArray m_offsets;
 };
 
 
+inline RFforest* RFbuilder::openForest(const char fname[],
+                                       const UintArray* subset, bool lazy,
+                                       uint nthreads)
+{
+    std::ifstream is(fname, std::ios::binary);
+    if (!is) {
+        LOG(Log::ERROR) << "Unable to open " << fname;
+        return NULL;
+    }
+
+    uint ncls = 0;
+    OffsetArray offsets;
+    unsigned long long indexOffset = 0;
+    bool indexed = readIndex(is, ncls, offsets, indexOffset);
+    is.clear();
+    is.seekg(0);
+
+    MappedFile::Ptr file;
+    if (indexed) {
+        file = new MappedFile;
+        if (!file->open(fname)) {
+            return NULL;
+        }
+        if (!checkIndex(*file, offsets, indexOffset)) {
+            LOG(Log::ERROR) << "Tree index doesn't match the trees in "
+                            << fname;
+            return NULL;
+        }
+    }
+
+    Deserialiser ds(is);
+    RFbuilder builder(ds);
+    RFforest* obj;
+    uint ntrees;
+
+    if (indexed) {
+        obj = new RFforest();
+        ntrees = builder.dRFforestHeader(obj, builder.nextToken());
+        if (ntrees != offsets.size()) {
+            LOG(Log::ERROR) << "Tree index doesn't match forest in " << fname;
+            delete obj;
+            return NULL;
+        }
+    }
+    else {
+        LOG(Log::DEBUG1) << "No tree index in " << fname
+                         << ", loading all trees";
+        // Finalised below, once the selected trees are known
+        obj = builder.dRFforest(false);
+        ntrees = obj->numTrees();
+    }
+
+    UintArray all;
+    if (!subset) {
+        all.resize(ntrees);
+        for (uint n = 0; n < ntrees; ++n) {
+            all[n] = n;
+        }
+        subset = &all;
+    }
+    if (subset->empty()) {
+        LOG(Log::ERROR) << "No trees selected";
+        delete obj;
+        return NULL;
+    }
+    for (uint n = 0; n < subset->size(); ++n) {
+        if ((*subset)[n] >= ntrees) {
+            LOG(Log::ERROR) << "Tree " << (*subset)[n] << " not in forest";
+            delete obj;
+            return NULL;
+        }
+    }
+
+    std::vector<RFtree::Ptr> trees(subset->size());
+    if (indexed) {
+        OffsetArray selected(subset->size());
+        for (uint n = 0; n < subset->size(); ++n) {
+            selected[n] = offsets[(*subset)[n]];
+        }
+        obj->m_numClasses = ncls;
+        obj->m_loader = new IndexedTreeLoader(file, selected);
+    }
+    else {
+        for (uint n = 0; n < subset->size(); ++n) {
+            trees[n] = obj->m_trees[(*subset)[n]];
+        }
+    }
+
+    obj->m_trees = trees;
+    obj->finalise();
+    if (!lazy) {
+        obj->loadAll(nthreads);
+    }
+    return obj;
+}
+
+
 
 #endif // YARF_RFDESERIALISE_HPP
@@ -0,0 +1,261 @@
+/**
+ * A compact array layout of a tree for fast prediction
+ */
+#ifndef YARF_RFFLAT_HPP
+#define YARF_RFFLAT_HPP
+
+#include <queue>
+#include <utility>
+#include "RFtypes.hpp"
+#include "RFnode.hpp"
+#include "RFleafpool.hpp"
+
+
+/**
+ * A node of a flattened tree. The more frequently visited (near) child of an
+ * internal node is always stored immediately after it, the index of the
+ * other (far) child is stored explicitly.
+ */
+struct FlatNode
+{
+    /**
+     * Flag set in ftid if this is a leaf
+     */
+    static const uint Leaf = 0x80000000u;
+
+    /**
+     * Flag set in ftid if the near child is the right child
+     */
+    static const uint NearRight = 0x40000000u;
+
+    /**
+     * Flag set in ftid if the split is a set of categories
+     */
+    static const uint Categorical = 0x20000000u;
+
+    /**
+     * Flag set in ftid if samples with a missing (NaN) value go right
+     */
+    static const uint MissingRight = 0x10000000u;
+
+    /**
+     * Mask to extract the feature id from ftid
+     */
+    static const uint FeatureMask = 0x0fffffffu;
+
+    union
+    {
+        /**
+         * Split value, samples go right if d[feature()] >= splitval
+         */
+        Ftval splitval;
+
+        /**
+         * If Categorical is set, samples go right if d[feature()] is one
+         * of these categories
+         */
+        SplitSelector::CategorySet categories;
+    };
+
+    /**
+     * Feature id and flags
+     */
+    uint ftid;
+
+    /**
+     * Index of the far child, or the leaf pool index if this is a leaf
+     */
+    uint far;
+
+    bool isLeaf() const {
+        return ftid & Leaf;
+    }
+
+    uint feature() const {
+        return ftid & FeatureMask;
+    }
+
+    /**
+     * Get the index of the next node for a feature value
+     * i: Index of this node
+     * x: The value of feature()
+     */
+    uint next(uint i, Ftval x) const {
+        bool goRight = (ftid & Categorical)?
+            SplitSelector::inCategories(categories, x):
+            x >= splitval ||
+            ((ftid & MissingRight) && SplitSelector::isMissing(x));
+        bool nearRight = ftid & NearRight;
+        return goRight == nearRight? i + 1: far;
+    }
+};
+
+typedef std::vector<FlatNode> FlatNodeArray;
+
+
+/**
+ * Find the leaf node reached by a sample in a flattened tree
+ * nodes: The flattened tree
+ * d: Sample to be predicted, anything with an operator[] returning the value
+ *    of a feature
+ * i: Index of the node to start from
+ * Returns the index of the leaf node
+ */
+template <typename SampleT>
+inline uint flatFindNode(const FlatNode* nodes, const SampleT& d, uint i = 0)
+{
+    while (!nodes[i].isLeaf()) {
+        i = nodes[i].next(i, d[nodes[i].feature()]);
+    }
+    return i;
+}
+
+
+/**
+ * Find the leaf reached by a sample in a flattened tree
+ * nodes: The flattened tree
+ * d: Sample to be predicted, anything with an operator[] returning the value
+ *    of a feature
+ * Returns the leaf pool index of the leaf
+ */
+template <typename SampleT>
+inline uint flatFindLeaf(const FlatNode* nodes, const SampleT& d)
+{
+    return nodes[flatFindNode(nodes, d)].far;
+}
+
+
+/**
+ * Converts a tree into an array of FlatNodes using the number of training
+ * samples at each node to estimate how frequently it is visited.
+ *
+ * Nodes are laid out as chains in which each node is followed by its hotter
+ * child. Chains are started in order of decreasing visit frequency from a
+ * priority queue of the colder children not yet placed, so the frequently
+ * visited top levels of the tree are packed into the first cache lines and
+ * a typical root to leaf path touches as few cache lines as possible.
+ */
+class TreeFlattener
+{
+public:
+    /**
+     * Flatten a tree
+     * nodes: Array to hold the flattened tree
+     * root: Root of the tree, all leaves must have been added to a LeafPool
+     * counts: If not NULL, array to hold the number of training samples at
+     *         each node of the flattened tree
+     * Returns false if the tree contains a split or leaf which can't be
+     * represented, in which case nodes is empty
+     */
+    static bool flatten(FlatNodeArray& nodes, const RFnode& root,
+                        UintArray* counts = NULL) {
+        nodes.clear();
+        if (counts) {
+            counts->clear();
+        }
+
+        // Priority queue of chains to be started, the parent index is -1 for
+        // the root
+        std::priority_queue<Pending> pending;
+        uint seq = 0;
+        pending.push(Pending(&root, uint(-1), seq++));
+
+        while (!pending.empty()) {
+            Pending p = pending.top();
+            pending.pop();
+
+            if (p.parent != uint(-1)) {
+                nodes[p.parent].far = nodes.size();
+            }
+
+            const RFnode* node = p.node;
+            while (true) {
+                FlatNode f;
+                f.splitval = 0;
+                f.far = 0;
+                if (counts) {
+                    counts->push_back(node->numSamples());
+                }
+
+                if (node->isleaf()) {
+                    if (node->leafId() == LeafPool::NoLeaf) {
+                        return fail(nodes, counts);
+                    }
+                    f.ftid = FlatNode::Leaf;
+                    f.far = node->leafId();
+                    nodes.push_back(f);
+                    break;
+                }
+
+                uint ftid;
+                const SplitSelector& split = *node->getSplit();
+                if (split.getThreshold(ftid, f.splitval)) {
+                    f.ftid = split.missingGoesRight()?
+                        FlatNode::MissingRight: 0;
+                }
+                else if (split.getCategories(ftid, f.categories)) {
+                    f.ftid = FlatNode::Categorical;
+                }
+                else {
+                    return fail(nodes, counts);
+                }
+                if (ftid > FlatNode::FeatureMask) {
+                    return fail(nodes, counts);
+                }
+                f.ftid |= ftid;
+
+                const RFnode* near = node->left().get();
+                const RFnode* far = node->right().get();
+                if (far->numSamples() > near->numSamples()) {
+                    std::swap(near, far);
+                    f.ftid |= FlatNode::NearRight;
+                }
+
+                pending.push(Pending(far, nodes.size(), seq++));
+                nodes.push_back(f);
+                node = near;
+            }
+        }
+
+        return true;
+    }
+
+protected:
+    /**
+     * Clear the output arrays, always returns false
+     */
+    static bool fail(FlatNodeArray& nodes, UintArray* counts) {
+        nodes.clear();
+        if (counts) {
+            counts->clear();
+        }
+        return false;
+    }
+
+    /**
+     * A subtree which hasn't been placed yet
+     */
+    struct Pending
+    {
+        Pending(const RFnode* node, uint parent, uint seq):
+            node(node), parent(parent), seq(seq) {
+        }
+
+        /**
+         * Most frequently visited first, then in order of creation
+         */
+        bool operator<(const Pending& p) const {
+            if (node->numSamples() != p.node->numSamples()) {
+                return node->numSamples() < p.node->numSamples();
+            }
+            return seq > p.seq;
+        }
+
+        const RFnode* node;
+        uint parent;
+        uint seq;
+    };
+};
+
+
+#endif // YARF_RFFLAT_HPP
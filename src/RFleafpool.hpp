@@ -0,0 +1,184 @@
+/**
+ * A shared pool of quantised leaf class distributions
+ */
+#ifndef YARF_RFLEAFPOOL_HPP
+#define YARF_RFLEAFPOOL_HPP
+
+#include <cassert>
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include "RFtypes.hpp"
+
+
+/**
+ * Normalised leaf class distributions stored as 16-bit fixed point values.
+ * Identical distributions (in particular pure leaves, which are very common)
+ * are stored once and referenced by index from each leaf.
+ */
+class LeafPool
+{
+public:
+    typedef RefCountPtr<LeafPool> Ptr;
+    typedef unsigned short Quantum;
+
+    /**
+     * Index used by leaves which have not been added to a pool
+     */
+    static const uint NoLeaf = uint(-1);
+
+    /**
+     * The fixed point value representing a probability of 1
+     */
+    static const uint QuantumMax = 65535;
+
+    /**
+     * Create an empty pool
+     * ncls: Number of classes
+     */
+    LeafPool(uint ncls):
+        m_ncls(ncls) {
+    }
+
+    /**
+     * Add a distribution to the pool, returns the index of the (possibly
+     * pre-existing) pooled distribution
+     * counts: Class frequencies (unnormalised), if they are all zero the
+     *         distribution is uniform
+     */
+    uint add(const DoubleArray& counts) {
+        assert(counts.size() == m_ncls);
+        double total = std::accumulate(counts.begin(), counts.end(), 0.0);
+
+        std::vector<Quantum> q(m_ncls);
+        for (uint c = 0; c < m_ncls; ++c) {
+            double p = total > 0? counts[c] / total: 1.0 / m_ncls;
+            q[c] = Quantum(p * QuantumMax + 0.5);
+        }
+
+        if (m_index.empty() && !m_dists.empty()) {
+            rebuildIndex();
+        }
+
+        std::map<std::vector<Quantum>, uint>::const_iterator it =
+            m_index.find(q);
+        if (it != m_index.end()) {
+            return it->second;
+        }
+
+        uint n = size();
+        m_dists.insert(m_dists.end(), q.begin(), q.end());
+        m_index[q] = n;
+        return n;
+    }
+
+    /**
+     * Get a normalised class distribution
+     * dist: Array to hold the class distribution
+     * n: Index of the distribution
+     */
+    void get(DoubleArray& dist, uint n) const {
+        dist.resize(m_ncls);
+        const Quantum* q = entry(n);
+        for (uint c = 0; c < m_ncls; ++c) {
+            dist[c] = q[c] * scale();
+        }
+    }
+
+    /**
+     * Add a normalised class distribution to an array of numClasses() values
+     * dist: The array to be incremented
+     * n: Index of the distribution
+     */
+    void accumulate(double* dist, uint n) const {
+        const Quantum* q = entry(n);
+        for (uint c = 0; c < m_ncls; ++c) {
+            dist[c] += q[c] * scale();
+        }
+    }
+
+    /**
+     * Return the largest class probability of a distribution
+     * n: Index of the distribution
+     */
+    double maxProbability(uint n) const {
+        const Quantum* q = entry(n);
+        return *std::max_element(q, q + m_ncls) * scale();
+    }
+
+    /**
+     * Convert a fixed point value to a probability
+     */
+    static double probability(Quantum q) {
+        return q * scale();
+    }
+
+    /**
+     * Get the raw fixed point values of a distribution
+     * n: Index of the distribution
+     */
+    const Quantum* entry(uint n) const {
+        assert(n < size());
+        return &m_dists[n * m_ncls];
+    }
+
+    /**
+     * Return the number of distinct distributions
+     */
+    uint size() const {
+        return m_ncls == 0? 0: m_dists.size() / m_ncls;
+    }
+
+    /**
+     * Return the number of classes
+     */
+    uint numClasses() const {
+        return m_ncls;
+    }
+
+    /**
+     * Release the memory used for deduplication, it will be rebuilt if
+     * further distributions are added
+     */
+    void compact() {
+        m_index.clear();
+        std::vector<Quantum>(m_dists).swap(m_dists);
+    }
+
+protected:
+    /**
+     * Rebuild the deduplication index from the stored distributions
+     */
+    void rebuildIndex() {
+        for (uint n = 0; n < size(); ++n) {
+            const Quantum* q = entry(n);
+            m_index[std::vector<Quantum>(q, q + m_ncls)] = n;
+        }
+    }
+
+private:
+    /**
+     * Multiplier to convert a fixed point value to a probability
+     */
+    static double scale() {
+        return 1.0 / QuantumMax;
+    }
+
+    /**
+     * Number of classes
+     */
+    uint m_ncls;
+
+    /**
+     * The distributions, m_dists[n * m_ncls + c] is class c of entry n
+     */
+    std::vector<Quantum> m_dists;
+
+    /**
+     * Map of distributions to indices, used to deduplicate
+     */
+    std::map<std::vector<Quantum>, uint> m_index;
+};
+
+
+#endif // YARF_RFLEAFPOOL_HPP
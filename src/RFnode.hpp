@@ -7,6 +7,7 @@
 #include "RFtypes.hpp"
 #include "RFparameters.hpp"
 #include "RFsplit.hpp"
+#include "RFleafpool.hpp"
 #include "RFutils.hpp"
 #include "RFserialise.hpp"
 #include "Logger.hpp"
@@ -27,10 +28,15 @@ public:
      * data: Dataset
      * ids: Array of sample ids to use
      * depth: Current node depth
+     * sides: Scratch space shared by the nodes of a tree, if NULL the root
+     *        node allocates it
+     * DatasetT: The dataset type, the whole subtree is built with feature
+     *           values read through DatasetAccess<DatasetT>
      */
-    RFnode(const RFparameters& params, const Dataset& data, const IdArray& ids,
-           uint depth = 0):
-        m_n(ids.size()), m_depth(depth) {
+    template <typename DatasetT>
+    RFnode(const RFparameters& params, const DatasetT& data, const IdArray& ids,
+           uint depth = 0, SplitSelector::SideArray* sides = NULL):
+        m_n(ids.size()), m_depth(depth), m_leaf(LeafPool::NoLeaf) {
 
         LOG(Log::DEBUG2) << indent(m_depth * 2)
                          << "ids: " << arrayToString(ids);
@@ -50,7 +56,8 @@ public:
                          << "counts: " << arrayToString(dist, false);
 
         if (m_split->splitRequired()) {
-            splitNode(params, data);
+            SplitSelector::SideArray scratch;
+            splitNode(params, data, sides? *sides: scratch);
         }
     }
 
@@ -69,6 +76,65 @@ public:
         }
     }
 
+    /**
+     * Add the normalised class frequencies to an array
+     * dist: Array of numClasses() values to be incremented
+     */
+    void addClassDistribution(double* dist) const {
+        double total = std::accumulate(m_counts.begin(), m_counts.end(), 0.0);
+        for (uint c = 0; c < m_counts.size(); ++c) {
+            dist[c] += m_counts[c] / total;
+        }
+    }
+
+    /**
+     * Return the number of classes
+     */
+    uint numClasses() const {
+        return m_counts.size();
+    }
+
+    /**
+     * Return the number of training samples which reached this node
+     */
+    uint numSamples() const {
+        return m_n;
+    }
+
+    /**
+     * Get the index of the normalised class distribution of this leaf in the
+     * leaf pool, LeafPool::NoLeaf if it hasn't been pooled
+     */
+    uint leafId() const {
+        return m_leaf;
+    }
+
+    /**
+     * Add the class distributions of all leaves under this node to a pool
+     * pool: The leaf distribution pool
+     */
+    void poolLeaves(LeafPool& pool) {
+        if (isleaf()) {
+            m_leaf = pool.add(m_counts);
+        }
+        else {
+            m_left->poolLeaves(pool);
+            m_right->poolLeaves(pool);
+        }
+    }
+
+    /**
+     * Return the largest class probability of any pooled leaf under this node
+     * pool: The leaf distribution pool
+     */
+    double maxLeafProbability(const LeafPool& pool) const {
+        if (isleaf()) {
+            return pool.maxProbability(m_leaf);
+        }
+        return std::max(m_left->maxLeafProbability(pool),
+                        m_right->maxLeafProbability(pool));
+    }
+
     /**
      * Get the split handler
      */
@@ -82,18 +148,21 @@ public:
      * d: Data sample to be predicted
      */
     void predict(DoubleArray& dist, const DataSample& d) const {
-        if (!isleaf()) {
-            bool goRight = m_split->predict(d);
-            if (goRight) {
-                m_right->predict(dist, d);
-            }
-            else {
-                m_left->predict(dist, d);
-            }
-        }
-        else {
-            getClassDistribution(dist, true);
+        findLeaf(d)->getClassDistribution(dist, true);
+    }
+
+    /**
+     * Find the leaf reached by a test sample. Makes a virtual call at every
+     * node, RFtree uses a flattened tree instead when it can.
+     * d: Data sample to be predicted
+     */
+    const RFnode* findLeaf(const DataSample& d) const {
+        const RFnode* node = this;
+        while (!node->isleaf()) {
+            bool goRight = node->m_split->predict(d);
+            node = goRight? node->m_right.get(): node->m_left.get();
         }
+        return node;
     }
 
     /**
@@ -141,18 +210,21 @@ protected:
     /**
      * Create two children by splitting the samples at this node using the
      * best split
+     * sides: Scratch space for splitting the samples
      */
-    void splitNode(const RFparameters& params, const Dataset& data) {
+    template <typename DatasetT>
+    void splitNode(const RFparameters& params, const DatasetT& data,
+                   SplitSelector::SideArray& sides) {
         assert(m_split->splitRequired());
 
         IdArray left, right;
-        m_split->splitSamples(left, right);
+        m_split->splitSamples(left, right, sides);
 
         LOG(Log::DEBUG2) << indent(m_depth * 2) << "Left";
-        m_left = new RFnode(params, data, left, m_depth + 1);
+        m_left = new RFnode(params, data, left, m_depth + 1, &sides);
 
         LOG(Log::DEBUG2) << indent(m_depth * 2) << "Right";
-        m_right = new RFnode(params, data, right, m_depth + 1);
+        m_right = new RFnode(params, data, right, m_depth + 1, &sides);
     }
 
 protected:
@@ -186,11 +258,17 @@ protected:
      */
     uint m_depth;
 
+    /**
+     * Index of the normalised class distribution in the leaf pool
+     */
+    uint m_leaf;
+
 private:
     /**
      * Default constructor for deserialisation only
      */
-    RFnode() {
+    RFnode():
+        m_leaf(LeafPool::NoLeaf) {
     }
     friend class RFbuilder;
 };
@@ -0,0 +1,125 @@
+/**
+ * Batch prediction using multiple threads
+ */
+#ifndef YARF_RFPREDICT_HPP
+#define YARF_RFPREDICT_HPP
+
+#include <algorithm>
+#include "Dataset.hpp"
+#include "RFtree.hpp"
+#include "RFserialise.hpp"
+#include "ThreadPool.hpp"
+
+
+/**
+ * Predicts the class labels of batches of samples, splitting each batch
+ * across a pool of threads. Each thread has its own scratch buffers which
+ * are reused between batches. Uses early exit prediction, so not all trees
+ * are necessarily evaluated for every sample.
+ */
+class BatchPredictor
+{
+public:
+    /**
+     * Create a batch predictor
+     * forest: The forest, must remain in scope for the life of the predictor
+     * nthreads: Number of threads, if 0 use the number of processors
+     * chunk: Number of samples predicted by a thread at a time
+     */
+    BatchPredictor(const RFforest& forest, uint nthreads = 0,
+                   uint chunk = 256):
+        m_forest(forest), m_pool(nthreads), m_chunk(chunk),
+        m_scratch(m_pool.size()) {
+        // Trees mustn't be loaded on demand by several threads
+        m_forest.loadAll();
+    }
+
+    /**
+     * Return the number of threads
+     */
+    uint numThreads() const {
+        return m_pool.size();
+    }
+
+    /**
+     * Predict the class labels of a batch of samples
+     * labels: Array of n elements to hold the predicted class labels
+     * data: The dataset
+     * ids: Array of n sample ids
+     * n: Number of samples
+     * DatasetT: The dataset type, feature values are read through
+     *           DatasetAccess<DatasetT> so a concrete type avoids a virtual
+     *           call for every node visited
+     */
+    template <typename DatasetT>
+    void predict(Label* labels, const DatasetT& data, const Id* ids, uint n) {
+        PredictTask<DatasetT> task(*this, labels, data, ids, n);
+        m_pool.run(task, (n + m_chunk - 1) / m_chunk);
+    }
+
+protected:
+    /**
+     * Per-thread buffers
+     */
+    struct Scratch
+    {
+        FtvalArray row;
+        DoubleArray dist;
+    };
+
+    /**
+     * Predicts one chunk of a batch per work item
+     */
+    template <typename DatasetT>
+    class PredictTask: public ParallelTask
+    {
+    public:
+        PredictTask(BatchPredictor& bp, Label* labels, const DatasetT& data,
+                    const Id* ids, uint n):
+            m_bp(bp), m_labels(labels), m_data(data), m_ids(ids), m_n(n) {
+        }
+
+        virtual void run(uint n, uint thread) {
+            Scratch& s = m_bp.m_scratch[thread];
+            uint from = n * m_bp.m_chunk;
+            uint to = std::min(from + m_bp.m_chunk, m_n);
+
+            for (uint i = from; i < to; ++i) {
+                m_labels[i] = m_bp.m_forest.predictEarly(
+                    s.dist,
+                    DatasetAccess<DatasetT>::sample(m_data, m_ids[i], s.row));
+            }
+        }
+
+    private:
+        BatchPredictor& m_bp;
+        Label* m_labels;
+        const DatasetT& m_data;
+        const Id* m_ids;
+        uint m_n;
+    };
+
+private:
+    /**
+     * The forest
+     */
+    const RFforest& m_forest;
+
+    /**
+     * The worker threads
+     */
+    ThreadPool m_pool;
+
+    /**
+     * Number of samples predicted by a thread at a time
+     */
+    uint m_chunk;
+
+    /**
+     * Buffers for each thread
+     */
+    std::vector<Scratch> m_scratch;
+};
+
+
+#endif // YARF_RFPREDICT_HPP
@@ -4,6 +4,7 @@
 #ifndef YARF_RFSERIALISE_HPP
 #define YARF_RFSERIALISE_HPP
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
 #include <limits>
@@ -76,6 +77,27 @@ std::string arrayToString(const ContainerT& xs, bool printSize = true,
     return oss.str();
 }
 
+/**
+ * Encode a set of ids as a bitmap in hexadecimal, prefixed by "0x" so that it
+ * can't be mistaken for a tag. Each digit holds four ids, the lowest id in
+ * the least significant bit.
+ */
+inline std::string idsToBitmap(const IdArray& ids)
+{
+    if (ids.empty()) {
+        return "0x";
+    }
+
+    std::string bits((*std::max_element(ids.begin(), ids.end())) / 4 + 1, 0);
+    for (IdArray::const_iterator it = ids.begin(); it != ids.end(); ++it) {
+        bits[*it / 4] |= 1 << (*it % 4);
+    }
+    for (std::string::iterator it = bits.begin(); it != bits.end(); ++it) {
+        *it = "0123456789abcdef"[int(*it)];
+    }
+    return "0x" + bits;
+}
+
 template<typename ContainerT>
 std::size_t getClass_MaxProb(const ContainerT& xs, size_t p1 = 0, size_t p2 = -1)
 {
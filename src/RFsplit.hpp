@@ -6,6 +6,7 @@
 
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include <set>
 
 #include "Dataset.hpp"
@@ -24,6 +25,23 @@ public:
     typedef RefCountPtr<SplitSelector> Ptr;
     typedef RefCountPtr<const SplitSelector> CPtr;
 
+    /**
+     * Bitmap of the categories of a categorical feature
+     */
+    typedef unsigned long long CategorySet;
+
+    /**
+     * The categories of a categorical feature are the integers
+     * [0, MaxCategories)
+     */
+    static const uint MaxCategories = 64;
+
+    /**
+     * Scratch space for splitSamples(), one byte per sample at a node. It
+     * is left zeroed so it can be reused for every node of a tree.
+     */
+    typedef std::vector<unsigned char> SideArray;
+
     /**
      * Find a split
      * fts: Array of feature values
@@ -49,9 +67,13 @@ public:
     virtual bool splitRequired() const = 0;
 
     /**
-     * Split the sample ids at this node into two parts
+     * Split the sample ids at this node into two parts, keeping their order
+     * left: The sample ids which go left
+     * right: The sample ids which go right
+     * sides: Scratch space, zeroed, which may be grown
      */
-    virtual void splitSamples(IdArray& left, IdArray& right) const = 0;
+    virtual void splitSamples(IdArray& left, IdArray& right,
+                              SideArray& sides) const = 0;
 
     /**
      * Get the size of the two nodes after the split
@@ -63,6 +85,34 @@ public:
      */
     virtual bool predict(const DataSample& d) const = 0;
 
+    /**
+     * Get the parameters of a split of the form: go right if
+     * d[ftid] >= splitval. Returns false if this isn't such a split.
+     * ftid: Set to the feature id
+     * splitval: Set to the split value
+     */
+    virtual bool getThreshold(uint&, Ftval&) const {
+        return false;
+    }
+
+    /**
+     * Get the parameters of a split of the form: go right if the category
+     * d[ftid] is in a set. Returns false if this isn't such a split.
+     * ftid: Set to the feature id
+     * categories: Set to the categories which go right
+     */
+    virtual bool getCategories(uint&, CategorySet&) const {
+        return false;
+    }
+
+    /**
+     * Return true if samples with a missing (NaN) value of the split
+     * feature go right
+     */
+    virtual bool missingGoesRight() const {
+        return false;
+    }
+
     /**
      * Save this object
      */
@@ -97,6 +147,32 @@ public:
         return n == 1;
     }
 
+    /**
+     * Return the category of a feature value, or MaxCategories if the value
+     * isn't a category
+     */
+    static uint category(Ftval x) {
+        return (x >= 0 && x < MaxCategories && x == uint(x))?
+            uint(x): MaxCategories;
+    }
+
+    /**
+     * Check whether a feature value is missing, missing values are NaN
+     */
+    static bool isMissing(Ftval x) {
+        // Only NaN compares unequal to itself
+        return x != x;
+    }
+
+    /**
+     * Check whether a feature value is one of a set of categories, values
+     * which aren't categories never are
+     */
+    static bool inCategories(CategorySet categories, Ftval x) {
+        uint c = category(x);
+        return c < MaxCategories && ((categories >> c) & 1);
+    }
+
 protected:
     SplitSelector() { }
 };
@@ -118,6 +194,12 @@ public:
      */
     static const double EPSILON = 1e-15;
 
+    /**
+     * Largest number of categories for which all subsets are tested when
+     * there are more than two classes
+     */
+    static const uint MaxSubsetSearch = 8;
+
     /**
      * Find the split which leads to the maximum information gain
      * fts: Array of feature values
@@ -125,17 +207,62 @@ public:
      * ls: Array of target labels
      * ids: reference ids of the samples in fts and ls
      * counts: Array of counts (should sum to ls.size())
+     * categorical: If true the feature values are categories, and the split
+     *              is a set of categories which go right
+     *
+     * Feature values may be missing (NaN). For a threshold split the
+     * missing samples are tried on both sides of every split, and the
+     * direction with the higher gain is used when predicting. Missing
+     * values of a categorical feature always go left.
      */
     MaxInfoGainSingleSplit(const FtvalArray& fts, uint ftid,
                            const LabelArray& ls, const IdArray& ids,
-                           const DoubleArray& counts):
+                           const DoubleArray& counts,
+                           bool categorical = false):
         m_ids(ids), m_ftid(ftid), m_perm(ids.size()), m_counts(counts),
-        m_ig(ids.size()), m_splitpos(0), m_splitval(0) {
+        m_ig(ids.size()), m_splitpos(0), m_splitval(0), m_numZeros(0),
+        m_zeroPos(0), m_categorical(categorical), m_categories(0),
+        m_missingRight(false) {
         assert(ids.size() > 0);
         assert(fts.size() == ls.size() && fts.size() == ids.size());
 
+        if (categorical) {
+            categoricalInfogain(fts, ls);
+        }
+        else if (hasMissing(fts)) {
+            missingInfogain(fts, ls);
+        }
+        else {
+            sortperm(fts);
+            infogain(fts, ls);
+        }
+    }
+
+    /**
+     * Find the split which leads to the maximum information gain for a
+     * sparse feature. Only the nonzero values are sorted, the samples with
+     * implicit zero values are treated as a single block.
+     * fts: Array of the nonzero feature values
+     * pos: The index in ids of each nonzero value
+     * ftid: Feature id
+     * ls: Array of target labels
+     * ids: reference ids of the samples in ls
+     * counts: Array of counts (should sum to ls.size())
+     */
+    MaxInfoGainSingleSplit(const FtvalArray& fts, const UintArray& pos,
+                           uint ftid, const LabelArray& ls,
+                           const IdArray& ids, const DoubleArray& counts):
+        m_ids(ids), m_ftid(ftid), m_perm(fts.size()), m_counts(counts),
+        m_splitpos(0), m_splitval(0), m_numZeros(ids.size() - fts.size()),
+        m_zeroPos(0), m_categorical(false), m_categories(0),
+        m_missingRight(false) {
+        assert(ids.size() > 0);
+        assert(fts.size() == pos.size() && fts.size() <= ids.size());
+        assert(!hasMissing(fts));
+        assert(ls.size() == ids.size());
+
         sortperm(fts);
-        infogain(fts, ls);
+        sparseInfogain(fts, pos, ls);
     }
 
     /**
@@ -160,19 +287,80 @@ public:
     }
 
     /**
-     * Split the sample ids at this node into two parts
+     * Return true if this is a split of a categorical feature
      */
-    void splitSamples(IdArray& left, IdArray& right) const {
-        left.resize(m_splitpos);
-        for (uint i = 0; i < m_splitpos; ++i)
-        {
-            left[i] = m_ids[m_perm[i]];
+    bool isCategorical() const {
+        return m_categorical;
+    }
+
+    /**
+     * Return the categories which go right, for a categorical split
+     */
+    SplitSelector::CategorySet getCategories() const {
+        return m_categories;
+    }
+
+    /**
+     * Return true if samples with a missing feature value go right
+     */
+    bool missingGoesRight() const {
+        return m_missingRight;
+    }
+
+    /**
+     * Decide whether a feature value goes right
+     */
+    bool goRight(Ftval x) const {
+        if (m_categorical) {
+            return SplitSelector::inCategories(m_categories, x);
+        }
+        return x >= m_splitval ||
+            (m_missingRight && SplitSelector::isMissing(x));
+    }
+
+    /**
+     * Check whether any feature values are missing
+     */
+    static bool hasMissing(const FtvalArray& fts) {
+        for (uint i = 0; i < fts.size(); ++i) {
+            if (SplitSelector::isMissing(fts[i])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Split the sample ids at this node into two parts, each in the same
+     * order as the ids at this node. For a sparse feature the samples which
+     * aren't in m_perm have implicit zero values.
+     * left: The sample ids which go left
+     * right: The sample ids which go right
+     * sides: Scratch space, zeroed, which may be grown
+     */
+    void splitSamples(IdArray& left, IdArray& right,
+                      SplitSelector::SideArray& sides) const {
+        enum { Zero = 0, Left, Right };
+
+        uint nleft = nonzerosLeft();
+        bool zerosLeft = m_numZeros > 0 && m_splitpos > m_zeroPos;
+
+        if (sides.size() < m_ids.size()) {
+            sides.resize(m_ids.size(), Zero);
+        }
+        for (uint j = 0; j < m_perm.size(); ++j) {
+            sides[m_perm[j]] = (j < nleft)? Left: Right;
         }
 
-        right.resize(m_perm.size() - m_splitpos);
-        for (uint i = m_splitpos; i < m_perm.size(); ++i)
-        {
-            right[i - m_splitpos] = m_ids[m_perm[i]];
+        left.clear();
+        right.clear();
+        uint numLeft = nleft + (zerosLeft? m_numZeros: 0);
+        left.reserve(numLeft);
+        right.reserve(m_ids.size() - numLeft);
+        for (uint i = 0; i < m_ids.size(); ++i) {
+            bool goLeft = (sides[i] == Zero)? zerosLeft: sides[i] == Left;
+            (goLeft? left: right).push_back(m_ids[i]);
+            sides[i] = Zero;
         }
     }
 
@@ -186,7 +374,8 @@ public:
     // The next four functions are for debugging
 
     /**
-     * Get the array of infomation gain values for all valid splits
+     * Get the array of infomation gain values for all valid splits. For a
+     * sparse feature the block of implicit zeros is a single element.
      */
     const DoubleArray& getInfoGainArray() const {
         return m_ig;
@@ -194,7 +383,9 @@ public:
 
     /**
      * Permutation of samples in the two children in the form of iterators:
-     * A[permLeft()..permMiddle()-1], and A[permMiddle()..permRight()-1]
+     * A[permLeft()..permMiddle()-1], and A[permMiddle()..permRight()-1].
+     * For a sparse feature only the samples with nonzero values are
+     * included.
      */
     UintArray::const_iterator permLeft() const {
         return m_perm.begin();
@@ -205,7 +396,7 @@ public:
      * A[permLeft()..permMiddle()-1], and A[permMiddle()..permRight()-1]
      */
     UintArray::const_iterator permMiddle() const {
-        return m_perm.begin() + m_splitpos;
+        return m_perm.begin() + nonzerosLeft();
     }
 
     /**
@@ -227,12 +418,22 @@ public:
                << in(i) << "perm " << arrayToString(m_perm) << "\n"
                << in(i) << "ig " << arrayToString(m_ig) << "\n"
                << in(i) << "splitpos " << m_splitpos << "\n";
+            if (m_numZeros > 0) {
+                os << in(i) << "zeros " << m_numZeros << "\n"
+                   << in(i) << "zeropos " << m_zeroPos << "\n";
+            }
         }
         // Note m_splitval is a feature value whose precision might matter
         os << in(i) << "ftid " << m_ftid << "\n"
            << in(i) << "counts " << arrayToString(m_counts) << "\n"
-           << in(i) << "splitval " << strprecise(m_splitval) << "\n"
-           << in(i) << "}MaxInfoGainSingleSplit\n";
+           << in(i) << "splitval " << strprecise(m_splitval) << "\n";
+        if (m_categorical) {
+            os << in(i) << "categories " << m_categories << "\n";
+        }
+        if (m_missingRight) {
+            os << in(i) << "missingRight " << m_missingRight << "\n";
+        }
+        os << in(i) << "}MaxInfoGainSingleSplit\n";
     }
 
 protected:
@@ -294,6 +495,327 @@ protected:
         }
     }
 
+    /**
+     * Calculate the information gain for all possible valid splits of a
+     * sparse feature. The samples are considered in the order: negative
+     * values, the block of implicit zeros, positive values.
+     * fts: Array of nonzero feature values, m_perm must sort them
+     * pos: The index in m_ids of each nonzero value
+     * ls: Array of target labels for all samples
+     */
+    void sparseInfogain(const FtvalArray& fts, const UintArray& pos,
+                        const LabelArray& ls) {
+        uint n = m_ids.size();
+        uint nnz = fts.size();
+
+        // Class counts of the zero block are whatever the nonzeros leave
+        DoubleArray zeroCounts(m_counts);
+        for (uint j = 0; j < nnz; ++j) {
+            --zeroCounts[ls[pos[j]]];
+        }
+
+        while (m_zeroPos < nnz && fts[m_perm[m_zeroPos]] < 0) {
+            ++m_zeroPos;
+        }
+
+        // Elements in order, the zero block (if any) is element m_zeroPos
+        uint m = nnz + (m_numZeros > 0);
+        m_ig.assign(m, 0);
+
+        double ht = entropy(m_counts, n);
+        DoubleArray countsleft(m_counts.size());
+        DoubleArray countsright(m_counts);
+
+        // Number of samples in the left partition
+        uint nleft = 0;
+        Ftval prev = 0;
+        for (uint e = 0; e < m; ++e) {
+            bool zeros = m_numZeros > 0 && e == m_zeroPos;
+            uint j = (m_numZeros > 0 && e > m_zeroPos)? e - 1: e;
+            Ftval x = zeros? 0: fts[m_perm[j]];
+
+            if (e > 0 && !fequals(prev, x)) {
+                double hta = (nleft * entropy(countsleft, nleft) +
+                              (n - nleft) *
+                              entropy(countsright, n - nleft)) / n;
+                m_ig[e] = ht - hta;
+                if (m_ig[e] > m_ig[m_splitpos]) {
+                    m_splitpos = e;
+                    m_splitval = (prev + x) / 2;
+                }
+            }
+
+            // Move this element to the left partition
+            if (zeros) {
+                for (uint c = 0; c < m_counts.size(); ++c) {
+                    countsleft[c] += zeroCounts[c];
+                    countsright[c] -= zeroCounts[c];
+                }
+                nleft += m_numZeros;
+            }
+            else {
+                Label l = ls[pos[m_perm[j]]];
+                ++countsleft[l];
+                --countsright[l];
+                ++nleft;
+            }
+            prev = x;
+        }
+
+        // Store the permutation as indices into m_ids
+        for (uint j = 0; j < nnz; ++j) {
+            m_perm[j] = pos[m_perm[j]];
+        }
+    }
+
+    /**
+     * Calculate the information gain for all possible valid splits when some
+     * feature values are missing. Only the values which aren't missing are
+     * sorted, and every split is scored with the missing samples on the
+     * left and on the right. Sending only the missing samples left is also
+     * a valid split.
+     * fts: Array of feature values
+     * ls: Array of target labels
+     */
+    void missingInfogain(const FtvalArray& fts, const LabelArray& ls) {
+        uint n = m_ids.size();
+        uint ncls = m_counts.size();
+
+        // Sort the values which aren't missing to the front of m_perm
+        UintArray missing;
+        DoubleArray missingCounts(ncls);
+        uint k = 0;
+        for (uint i = 0; i < n; ++i) {
+            if (SplitSelector::isMissing(fts[i])) {
+                missing.push_back(i);
+                ++missingCounts[ls[i]];
+            }
+            else {
+                m_perm[k++] = i;
+            }
+        }
+        qsort(fts, 0, k);
+        uint nm = missing.size();
+
+        double ht = entropy(m_counts, n);
+        DoubleArray countsleft(ncls);
+        DoubleArray left(ncls);
+        DoubleArray right(ncls);
+
+        // Number of non-missing samples on the left of the best split
+        uint bestpos = 0;
+        double bestig = 0;
+
+        for (uint i = 0; i < k; ++i) {
+            if (i > 0) {
+                ++countsleft[ls[m_perm[i - 1]]];
+                if (fequals(fts[m_perm[i - 1]], fts[m_perm[i]])) {
+                    continue;
+                }
+            }
+
+            for (uint r = 0; r < 2; ++r) {
+                bool missingRight = r == 1;
+                if (i == 0 && missingRight) {
+                    // Nothing on the left
+                    continue;
+                }
+
+                uint nleft = missingRight? i: i + nm;
+                for (uint c = 0; c < ncls; ++c) {
+                    left[c] = countsleft[c] +
+                        (missingRight? 0: missingCounts[c]);
+                    right[c] = m_counts[c] - left[c];
+                }
+                double ig = ht - (nleft * entropy(left, nleft) +
+                                  (n - nleft) * entropy(right, n - nleft)) /
+                    n;
+                if (ig > bestig) {
+                    bestig = ig;
+                    bestpos = i;
+                    m_missingRight = missingRight;
+                }
+            }
+        }
+
+        if (bestig == 0) {
+            // No split, keep the missing samples at the end
+            std::copy(missing.begin(), missing.end(), m_perm.begin() + k);
+            m_ig[0] = 0;
+            return;
+        }
+
+        m_splitval = bestpos == 0? -HUGE_VAL:
+            (fts[m_perm[bestpos - 1]] + fts[m_perm[bestpos]]) / 2;
+
+        if (m_missingRight) {
+            std::copy(missing.begin(), missing.end(), m_perm.begin() + k);
+            m_splitpos = bestpos;
+        }
+        else {
+            std::copy_backward(m_perm.begin(), m_perm.begin() + k,
+                               m_perm.end());
+            std::copy(missing.begin(), missing.end(), m_perm.begin());
+            m_splitpos = nm + bestpos;
+        }
+        m_ig[m_splitpos] = bestig;
+    }
+
+    /**
+     * Find the set of categories which leads to the maximum information
+     * gain when sent right, values which aren't categories always go left.
+     * With two classes, or too many categories for an exhaustive search,
+     * the categories are sorted by the proportion of the most frequent
+     * class and only splits of this order are tested.
+     * fts: Array of feature values
+     * ls: Array of target labels
+     */
+    void categoricalInfogain(const FtvalArray& fts, const LabelArray& ls) {
+        const uint MaxCategories = SplitSelector::MaxCategories;
+        uint n = m_ids.size();
+        uint ncls = m_counts.size();
+
+        // Class counts of each category, then of the values which aren't
+        // categories
+        std::vector<DoubleArray> catCounts(MaxCategories + 1,
+                                           DoubleArray(ncls));
+        UintArray cats(n);
+        for (uint i = 0; i < n; ++i) {
+            cats[i] = SplitSelector::category(fts[i]);
+            ++catCounts[cats[i]][ls[i]];
+        }
+
+        UintArray present;
+        for (uint c = 0; c < MaxCategories; ++c) {
+            if (sum(catCounts[c]) > 0) {
+                present.push_back(c);
+            }
+        }
+
+        double ht = entropy(m_counts, n);
+        double bestig = 0;
+        DoubleArray countsright(ncls);
+
+        if (ncls > 2 && present.size() <= MaxSubsetSearch) {
+            for (uint mask = 1; mask < (1u << present.size()); ++mask) {
+                SplitSelector::CategorySet set = 0;
+                std::fill(countsright.begin(), countsright.end(), 0);
+                for (uint j = 0; j < present.size(); ++j) {
+                    if ((mask >> j) & 1) {
+                        set |= 1ull << present[j];
+                        add(countsright, catCounts[present[j]]);
+                    }
+                }
+
+                double ig = ht - splitEntropy(countsright, n);
+                if (ig > bestig) {
+                    bestig = ig;
+                    m_categories = set;
+                }
+            }
+        }
+        else {
+            uint k = std::max_element(m_counts.begin(), m_counts.end()) -
+                m_counts.begin();
+            std::stable_sort(present.begin(), present.end(),
+                             ClassProportionLess(catCounts, k));
+
+            // Move categories right from the end of the order
+            SplitSelector::CategorySet set = 0;
+            for (uint j = present.size(); j-- > 0; ) {
+                set |= 1ull << present[j];
+                add(countsright, catCounts[present[j]]);
+
+                double ig = ht - splitEntropy(countsright, n);
+                if (ig > bestig) {
+                    bestig = ig;
+                    m_categories = set;
+                }
+            }
+        }
+
+        // Order the samples as left then right
+        UintArray right;
+        uint nleft = 0;
+        for (uint i = 0; i < n; ++i) {
+            if (cats[i] < MaxCategories && ((m_categories >> cats[i]) & 1)) {
+                right.push_back(i);
+            }
+            else {
+                m_perm[nleft++] = i;
+            }
+        }
+        std::copy(right.begin(), right.end(), m_perm.begin() + nleft);
+
+        if (m_categories != 0) {
+            m_splitpos = nleft;
+            m_ig[m_splitpos] = bestig;
+        }
+    }
+
+    /**
+     * Orders categories by the proportion of one class
+     */
+    class ClassProportionLess
+    {
+    public:
+        ClassProportionLess(const std::vector<DoubleArray>& counts,
+                            uint cls):
+            m_counts(counts), m_cls(cls) {
+        }
+
+        bool operator()(uint a, uint b) const {
+            return m_counts[a][m_cls] * sum(m_counts[b]) <
+                m_counts[b][m_cls] * sum(m_counts[a]);
+        }
+
+    private:
+        const std::vector<DoubleArray>& m_counts;
+        uint m_cls;
+    };
+
+    /**
+     * Weighted entropy of the two partitions of a split, or the entropy of
+     * all samples if either partition is empty so there is no gain
+     * countsright: Class counts of the right partition
+     * n: Total number of samples
+     */
+    double splitEntropy(const DoubleArray& countsright, uint n) {
+        uint nright = sum(countsright) + 0.5;
+        if (nright == 0 || nright == n) {
+            return entropy(m_counts, n);
+        }
+
+        DoubleArray countsleft(m_counts);
+        for (uint c = 0; c < countsleft.size(); ++c) {
+            countsleft[c] -= countsright[c];
+        }
+        return ((n - nright) * entropy(countsleft, n - nright) +
+                nright * entropy(countsright, nright)) / n;
+    }
+
+    static double sum(const DoubleArray& xs) {
+        double t = 0;
+        for (uint i = 0; i < xs.size(); ++i) {
+            t += xs[i];
+        }
+        return t;
+    }
+
+    static void add(DoubleArray& xs, const DoubleArray& ys) {
+        for (uint i = 0; i < xs.size(); ++i) {
+            xs[i] += ys[i];
+        }
+    }
+
+    /**
+     * Number of samples with nonzero values in the left partition
+     */
+    uint nonzerosLeft() const {
+        return (m_numZeros > 0 && m_splitpos > m_zeroPos)?
+            m_splitpos - 1: m_splitpos;
+    }
+
     /**
      * Calculate the entropy from a set of label counts
      * counts: Frequency of each class label
@@ -370,7 +892,9 @@ private:
     /**
      * Default constructor for deserialisation only
      */
-    MaxInfoGainSingleSplit() {
+    MaxInfoGainSingleSplit():
+        m_numZeros(0), m_zeroPos(0), m_categorical(false), m_categories(0),
+        m_missingRight(false) {
     }
     friend class RFbuilder;
 
@@ -408,6 +932,31 @@ private:
      * Value of the feature split
      */
     Ftval m_splitval;
+
+    /**
+     * Number of samples with implicit zero values, only for sparse features
+     */
+    uint m_numZeros;
+
+    /**
+     * Index in the sorted nonzeros at which the implicit zeros belong
+     */
+    uint m_zeroPos;
+
+    /**
+     * Whether the feature is categorical
+     */
+    bool m_categorical;
+
+    /**
+     * The categories which go right, for a categorical feature
+     */
+    SplitSelector::CategorySet m_categories;
+
+    /**
+     * Whether samples with missing values go right
+     */
+    bool m_missingRight;
 };
 
 
@@ -431,8 +980,11 @@ public:
      * ls: Array of target labels
      * ids: reference ids of the samples in fts and ls
      * counts: Array of counts (should sum to ls.size())
+     * DatasetT: The dataset type, feature values are read through
+     *           DatasetAccess<DatasetT>
      */
-    MaxInfoGainSplit(const RFparameters& params, const Dataset& data,
+    template <typename DatasetT>
+    MaxInfoGainSplit(const RFparameters& params, const DatasetT& data,
                      const LabelArray& ls, const IdArray& ids,
                      const DoubleArray& counts):
         m_counts(counts), m_gotSplit(false), m_bestft(-1) {
@@ -459,16 +1011,38 @@ public:
         return m_gotSplit;
     }
 
-    virtual void splitSamples(IdArray& left, IdArray& right) const {
+    virtual void splitSamples(IdArray& left, IdArray& right,
+                              SideArray& sides) const {
         assert(splitRequired());
-        m_splits[m_bestft]->splitSamples(left, right);
+        m_splits[m_bestft]->splitSamples(left, right, sides);
     }
 
     virtual bool predict(const DataSample& d) const {
         assert(splitRequired());
-        bool goRight = d[m_splits[m_bestft]->getFeatureId()] >=
-            m_splits[m_bestft]->getSplitValue();
-        return goRight;
+        const MaxInfoGainSingleSplit& s = *m_splits[m_bestft];
+        return s.goRight(d[s.getFeatureId()]);
+    }
+
+    virtual bool getThreshold(uint& ftid, Ftval& splitval) const {
+        if (!splitRequired() || m_splits[m_bestft]->isCategorical()) {
+            return false;
+        }
+        ftid = m_splits[m_bestft]->getFeatureId();
+        splitval = m_splits[m_bestft]->getSplitValue();
+        return true;
+    }
+
+    virtual bool getCategories(uint& ftid, CategorySet& categories) const {
+        if (!splitRequired() || !m_splits[m_bestft]->isCategorical()) {
+            return false;
+        }
+        ftid = m_splits[m_bestft]->getFeatureId();
+        categories = m_splits[m_bestft]->getCategories();
+        return true;
+    }
+
+    virtual bool missingGoesRight() const {
+        return splitRequired() && m_splits[m_bestft]->missingGoesRight();
     }
 
     MaxInfoGainSingleSplit::Ptr getSplit() const {
@@ -507,13 +1081,21 @@ protected:
     /**
      * Test multiple random features
      */
-    void testFeatures(const RFparameters& params, const Dataset& data,
+    template <typename DatasetT>
+    void testFeatures(const RFparameters& params, const DatasetT& data,
                       const LabelArray& ls, const IdArray& ids) {
+        typedef DatasetAccess<DatasetT> Access;
+
         m_splits.reserve(params.numSplitFeatures);
 
         double bestig = 0;
         std::set<uint> selected;
 
+        // Reused for every feature, so only allocated once per node
+        FtvalArray fts;
+        UintArray pos;
+        SortedIdIndex sortedIds(ids);
+
         for (uint i = 0; i < params.numSplitFeatures; ++i) {
             // Only test each feature once
             uint r;
@@ -523,11 +1105,30 @@ protected:
             while (selected.find(r) != selected.end());
             selected.insert(r);
 
-            FtvalArray fts;
-            data.getFeature(r)->select(fts, ids);
+            // Only features which aren't stored as a contiguous column need
+            // a FeatureSet, which may be sparse
+            MaxInfoGainSingleSplit::Ptr s;
+            Dataset::FeatureSetPtr ft;
+            bool categorical = data.isCategorical(r);
+            if (!categorical && !Access::Dense && !data.getColumn(r)) {
+                ft = data.getFeature(r);
+            }
 
-            MaxInfoGainSingleSplit::Ptr s = new MaxInfoGainSingleSplit(
-                fts, r, ls, ids, m_counts);
+            if (ft.get() && ft->selectNonzero(fts, pos, sortedIds) &&
+                !MaxInfoGainSingleSplit::hasMissing(fts)) {
+                s = new MaxInfoGainSingleSplit(fts, pos, r, ls, ids,
+                                               m_counts);
+            }
+            else {
+                if (ft.get()) {
+                    ft->select(fts, ids);
+                }
+                else {
+                    Access::selectFeature(data, fts, r, ids);
+                }
+                s = new MaxInfoGainSingleSplit(fts, r, ls, ids, m_counts,
+                                               categorical);
+            }
             m_splits.push_back(s);
 
             double ig = s->getInfoGain();
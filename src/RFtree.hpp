@@ -5,12 +5,18 @@
 #define YARF_RFTREE_HPP
 
 #include "Dataset.hpp"
+#include "MappedDataset.hpp"
 #include "RFnode.hpp"
+#include "RFflat.hpp"
 #include "RFutils.hpp"
 #include "RFserialise.hpp"
+#include "ThreadPool.hpp"
+#include <cstdio>
+#include <cstdlib>
 #include <vector>
 #include <algorithm>
 #include <functional>
+#include <numeric>
 
 
 /**
@@ -21,16 +27,74 @@ class RFtree
 public:
     typedef RefCountPtr<RFtree> Ptr;
 
+    /**
+     * The OOB samples of a tree ordered by the pre-order position of the
+     * leaf of the flattened tree they reach, so that the samples passing
+     * through any node are contiguous. Used to update the OOB predictions
+     * when the values of one feature change, without routing the samples
+     * which never reach a split on that feature. Built by indexOob().
+     */
+    struct OobIndex
+    {
+        /**
+         * Return true if any node of the tree splits on a feature
+         */
+        bool splitsOn(uint ftid) const {
+            return ftid + 1 < featureStart.size() &&
+                featureStart[ftid] != featureStart[ftid + 1];
+        }
+
+        /**
+         * Indices of the OOB samples (into the OOB ids) in leaf order
+         */
+        UintArray order;
+
+        /**
+         * start[k]: Position in order of the first sample whose leaf is at
+         * pre-order position k or later
+         */
+        UintArray start;
+
+        /**
+         * Predicted probability of the true class of each OOB sample
+         */
+        DoubleArray score;
+
+        /**
+         * Pre-order position of each node, and one past the position of its
+         * last descendant
+         */
+        UintArray pre;
+        UintArray last;
+
+        /**
+         * The nodes which split on feature f in pre-order are
+         * featureNodes[featureStart[f]..featureStart[f + 1])
+         */
+        UintArray featureStart;
+        UintArray featureNodes;
+
+        /**
+         * Scratch buffers
+         */
+        UintArray byPre;
+        UintArray cursor;
+    };
+
     /**
      * A random forest tree
      * data: The underlying dataset, must remain in scope for the life of the
      *       tree
      * params: Random forest parameters
+     * DatasetT: The dataset type, a concrete type such as SingleMatrixDataset
+     *           is trained without virtual calls for each feature value, see
+     *           DatasetAccess
      */
-    RFtree(const Dataset* data, RFparameters::Ptr params):
-        m_data(data), m_params(params) {
+    template <typename DatasetT>
+    RFtree(const DatasetT* data, RFparameters::Ptr params):
+        m_data(data), m_params(params), m_maxLeafProb(1) {
         data->getIds(m_ids);
-        buildTree();
+        buildTree(*data);
     }
 
     ~RFtree() { }
@@ -61,48 +125,298 @@ public:
     }
 
     /**
-     * Calculate variable importance for a feature using the OOB samples with a
-     * permuted data set
-     * permuted: The data set with the values of feature ftid permuted
-     * ftid: The id of the permuted feature
-     * Returns the feature importance
+     * Return the number of OOB samples
      */
-    double varImp(const Dataset& permuted, uint ftid) const {
-        // Variable importance:
-        // Votes for correct class - Votes for correct class in permuted data
-        // averaged over OOB samples
-        ConfusionMatrix pcm(permuted.numClasses());
-        oobPredict(pcm, permuted);
+    uint numOob() const {
+        return m_oob.size();
+    }
 
-        ConfusionMatrix cm(m_data->numClasses());
-        oobPredict(cm, *m_data);
+    /**
+     * Get the values of a feature for the OOB samples
+     * fts: Array to hold the values, in the order of the OOB sample ids
+     * data: The dataset
+     * ftid: The feature id
+     */
+    template <typename DatasetT>
+    void selectOob(FtvalArray& fts, const DatasetT& data, uint ftid) const {
+        DatasetAccess<DatasetT>::selectFeature(data, fts, ftid, m_oob);
+    }
 
-        double imp = 0.0;
-        for (Label i = 0; i < m_data->numClasses(); ++i) {
-            imp += cm.score(i, i) - pcm.score(i, i);
+    /**
+     * Sum over the OOB samples of the predicted probability of the true
+     * class, the score used by variable importance
+     * data: The dataset
+     * row, dist: Scratch buffers
+     */
+    template <typename DatasetT>
+    double oobScore(const DatasetT& data, FtvalArray& row, DoubleArray& dist)
+        const {
+        typedef DatasetAccess<DatasetT> Access;
+        double score = 0;
+        for (uint i = 0; i < m_oob.size(); ++i) {
+            predict(dist, Access::sample(data, m_oob[i], row));
+            score += dist[data.getLabel(m_oob[i])];
         }
-        assert(cm.total() == pcm.total());
-        return imp / cm.total();
+        return score;
+    }
+
+    /**
+     * The OOB score with the values of one feature replaced
+     * data: The dataset
+     * ftid: The id of the replaced feature
+     * fts: The values of feature ftid, in the order of the OOB sample ids
+     * row, dist: Scratch buffers
+     */
+    template <typename DatasetT>
+    double oobScore(const DatasetT& data, uint ftid, const FtvalArray& fts,
+                    FtvalArray& row, DoubleArray& dist) const {
+        typedef DatasetAccess<DatasetT> Access;
+        assert(fts.size() == m_oob.size());
+        double score = 0;
+        for (uint i = 0; i < m_oob.size(); ++i) {
+            typename Access::Sample s = Access::sample(data, m_oob[i], row);
+            predict(dist, ReplacedFeatureSample<typename Access::Sample>(
+                        s, ftid, fts[i]));
+            score += dist[data.getLabel(m_oob[i])];
+        }
+        return score;
+    }
+
+    /**
+     * Route the OOB samples through the flattened tree and index them by
+     * the nodes they pass through
+     * index: The index, may be reused between trees to avoid allocating
+     * data: The dataset
+     * row: Scratch buffer
+     * Returns false if the tree hasn't been flattened
+     */
+    template <typename DatasetT>
+    bool indexOob(OobIndex& index, const DatasetT& data, FtvalArray& row)
+        const {
+        typedef DatasetAccess<DatasetT> Access;
+        if (m_flat.empty() || !m_pool) {
+            return false;
+        }
+        const FlatNode* nodes = &m_flat[0];
+        uint nn = m_flat.size();
+
+        // Pre-order positions, the near child is visited first
+        index.byPre.clear();
+        index.cursor.assign(1, 0);
+        while (!index.cursor.empty()) {
+            uint i = index.cursor.back();
+            index.cursor.pop_back();
+            index.byPre.push_back(i);
+            if (!nodes[i].isLeaf()) {
+                index.cursor.push_back(nodes[i].far);
+                index.cursor.push_back(i + 1);
+            }
+        }
+        assert(index.byPre.size() == nn);
+
+        index.pre.resize(nn);
+        index.last.resize(nn);
+        for (uint k = nn; k > 0; --k) {
+            uint i = index.byPre[k - 1];
+            index.pre[i] = k - 1;
+            index.last[i] = nodes[i].isLeaf()? k:
+                std::max(index.last[i + 1], index.last[nodes[i].far]);
+        }
+
+        // Split nodes of each feature, in pre-order
+        uint nf = data.numFeatures();
+        index.featureStart.assign(nf + 2, 0);
+        for (uint i = 0; i < nn; ++i) {
+            if (!nodes[i].isLeaf() && nodes[i].feature() < nf) {
+                ++index.featureStart[nodes[i].feature() + 2];
+            }
+        }
+        std::partial_sum(index.featureStart.begin(),
+                         index.featureStart.end(),
+                         index.featureStart.begin());
+        index.featureNodes.resize(index.featureStart.back());
+        for (uint k = 0; k < nn; ++k) {
+            uint i = index.byPre[k];
+            if (!nodes[i].isLeaf() && nodes[i].feature() < nf) {
+                uint f = nodes[i].feature();
+                index.featureNodes[index.featureStart[f + 1]++] = i;
+            }
+        }
+        index.featureStart.pop_back();
+
+        // Route each sample, and order the samples by leaf
+        uint n = m_oob.size();
+        index.score.resize(n);
+        index.cursor.resize(n);
+        index.start.assign(nn + 1, 0);
+        for (uint k = 0; k < n; ++k) {
+            typename Access::Sample s = Access::sample(data, m_oob[k], row);
+            uint leaf = flatFindNode(nodes, s);
+            index.score[k] = LeafPool::probability(
+                m_pool->entry(nodes[leaf].far)[data.getLabel(m_oob[k])]);
+            index.cursor[k] = index.pre[leaf];
+            ++index.start[index.pre[leaf] + 1];
+        }
+        std::partial_sum(index.start.begin(), index.start.end(),
+                         index.start.begin());
+
+        index.order.resize(n);
+        index.byPre.assign(index.start.begin(), index.start.end() - 1);
+        for (uint k = 0; k < n; ++k) {
+            index.order[index.byPre[index.cursor[k]]++] = k;
+        }
+        return true;
+    }
+
+    /**
+     * The decrease in the OOB score when the values of one feature are
+     * replaced. Only the samples reaching a split on the feature are routed
+     * again, from the highest such split on their path.
+     * index: The index built by indexOob()
+     * data: The dataset
+     * ftid: The id of the replaced feature
+     * fts: The values of feature ftid, in the order of the OOB sample ids
+     * row: Scratch buffer
+     */
+    template <typename DatasetT>
+    double permutedOobLoss(const OobIndex& index, const DatasetT& data,
+                           uint ftid, const FtvalArray& fts, FtvalArray& row)
+        const {
+        typedef DatasetAccess<DatasetT> Access;
+        assert(fts.size() == m_oob.size());
+        if (!index.splitsOn(ftid)) {
+            return 0;
+        }
+        const FlatNode* nodes = &m_flat[0];
+
+        double loss = 0;
+        uint skipTo = 0;
+        for (uint n = index.featureStart[ftid];
+             n < index.featureStart[ftid + 1]; ++n) {
+            // Splits below another split on the same feature are reached
+            // from it
+            uint top = index.featureNodes[n];
+            if (index.pre[top] < skipTo) {
+                continue;
+            }
+            skipTo = index.last[top];
+
+            for (uint j = index.start[index.pre[top]];
+                 j < index.start[index.last[top]]; ++j) {
+                uint k = index.order[j];
+                typename Access::Sample s =
+                    Access::sample(data, m_oob[k], row);
+                uint leaf = flatFindNode(
+                    nodes, ReplacedFeatureSample<typename Access::Sample>(
+                        s, ftid, fts[k]), top);
+                loss += index.score[k] - LeafPool::probability(
+                    m_pool->entry(nodes[leaf].far)[data.getLabel(m_oob[k])]);
+            }
+        }
+        return loss;
     }
 
     /**
      * Get a prediction
      * dist: Array to hold the class predictions
+     * d: Sample to be predicted, anything with an operator[] returning the
+     *    value of a feature
      */
-    void predict(DoubleArray& dist, const DataSample& d) const {
-        m_root->predict(dist, d);
+    template <typename SampleT>
+    void predict(DoubleArray& dist, const SampleT& d) const {
+        if (m_pool) {
+            m_pool->get(dist, leafId(d));
+        }
+        else {
+            findLeaf(d)->getClassDistribution(dist, true);
+        }
     }
 
     /**
-     * Save this object
+     * Add the normalised class prediction of this tree to an array
+     * dist: Array of numClasses() values to be incremented
+     * d: Sample to be predicted, anything with an operator[]
+     */
+    template <typename SampleT>
+    void accumulate(double* dist, const SampleT& d) const {
+        if (m_pool) {
+            m_pool->accumulate(dist, leafId(d));
+        }
+        else {
+            findLeaf(d)->addClassDistribution(dist);
+        }
+    }
+
+    /**
+     * Get the leaf pool index of the leaf reached by a sample, only valid
+     * after finalise()
+     * d: Sample to be predicted, anything with an operator[]
      */
-    void serialise(std::ostream& os, uint level, uint i) const {
+    template <typename SampleT>
+    uint leafId(const SampleT& d) const {
+        if (!m_flat.empty()) {
+            return flatFindLeaf(&m_flat[0], d);
+        }
+        return findLeaf(d)->leafId();
+    }
+
+    /**
+     * Get the flattened tree, empty if the tree couldn't be flattened
+     */
+    const FlatNodeArray& getFlat() const {
+        return m_flat;
+    }
+
+    /**
+     * Precompute the normalised leaf distributions and the flattened tree
+     * used for prediction
+     * pool: The pool to which the leaf distributions are added, may be
+     *       shared between trees
+     */
+    void finalise(LeafPool::Ptr pool) {
+        m_pool = pool;
+        m_root->poolLeaves(*m_pool);
+        m_maxLeafProb = m_root->maxLeafProbability(*m_pool);
+
+        if (!TreeFlattener::flatten(m_flat, *m_root)) {
+            LOG(Log::WARNING) << "Tree can't be flattened, prediction will "
+                              << "be slower";
+        }
+    }
+
+    /**
+     * Return the largest class probability of any leaf, which is the most
+     * this tree can contribute to the votes for a class. Only valid after
+     * finalise().
+     */
+    double maxLeafProbability() const {
+        return m_maxLeafProb;
+    }
+
+    /**
+     * Save this object. At level 0 only what is needed for prediction is
+     * saved, with the OOB samples encoded as a bitmap of sample ids, since
+     * the training sample ids and bag are as large as the training set. At
+     * higher levels all the sample id arrays are saved.
+     * oob: If false don't save the OOB samples, so OOB errors and variable
+     *      importance can't be calculated for the loaded tree
+     */
+    void serialise(std::ostream& os, uint level, uint i, bool oob = true)
+        const {
         os << in(i) << "RFtree{\n"
-           << in(i) << "data " << "[0]" << "\n"
-           << in(i) << "ids " << arrayToString(m_ids) << "\n"
-           << in(i) << "bag " << arrayToString(m_bag) << "\n"
-           << in(i) << "oob " << arrayToString(m_oob) << "\n"
-           << in(i) << "params\n";
+           << in(i) << "data " << "[0]" << "\n";
+        if (level >= 1) {
+            os << in(i) << "ids " << arrayToString(m_ids) << "\n"
+               << in(i) << "bag " << arrayToString(m_bag) << "\n";
+        }
+        if (level >= 1 || m_oob.empty()) {
+            os << in(i) << "oob " << arrayToString(oob? m_oob: IdArray())
+               << "\n";
+        }
+        else if (oob) {
+            os << in(i) << "oobBits " << idsToBitmap(m_oob) << "\n";
+        }
+        os << in(i) << "params\n";
         m_params->serialise(os, level, i + 1);
         os << in(i) << "root\n";
         m_root->serialise(os, level, i + 1);
@@ -111,20 +425,22 @@ public:
 
 protected:
     /**
-     * Random selection of ids with replacement, and calculation of OOB samples
+     * Random selection of ids with replacement, and calculation of OOB
+     * samples. Both are in the order of m_ids (ascending for the built in
+     * datasets), the nodes split them stably so sparse features can be
+     * matched against sorted ids, see SortedIdIndex.
      */
     void randomBagOob(IdArray& bag, IdArray& oob) const {
-        std::vector<bool> selected(m_ids.size(), false);
-        bag.resize(m_ids.size());
-        oob.reserve(m_ids.size());
-
-        for (IdArray::iterator it = bag.begin(); it != bag.end(); ++it) {
-            uint r = Utils::randint(0, m_ids.size());
-            *it = m_ids[r];
-            selected[r] = true;
+        UintArray selected(m_ids.size(), 0);
+        for (uint i = 0; i < m_ids.size(); ++i) {
+            ++selected[Utils::randint(0, m_ids.size())];
         }
 
+        bag.clear();
+        bag.reserve(m_ids.size());
+        oob.reserve(m_ids.size());
         for (uint i = 0; i < selected.size(); ++i) {
+            bag.insert(bag.end(), selected[i], m_ids[i]);
             if (!selected[i]) {
                 oob.push_back(m_ids[i]);
             }
@@ -134,9 +450,22 @@ protected:
     /**
      * Build the tree
      */
-    void buildTree() {
+    template <typename DatasetT>
+    void buildTree(const DatasetT& data) {
         randomBagOob(m_bag, m_oob);
-        m_root = new RFnode(*m_params, *m_data, m_bag);
+        m_root = new RFnode(*m_params, data, m_bag);
+    }
+
+    /**
+     * Find the leaf reached by a sample by walking the unflattened tree
+     */
+    template <typename SampleT>
+    const RFnode* findLeaf(const SampleT& d) const {
+        return m_root->findLeaf(DataSampleAdapter<SampleT>(d));
+    }
+
+    const RFnode* findLeaf(const DataSample& d) const {
+        return m_root->findLeaf(d);
     }
 
     /**
@@ -144,17 +473,19 @@ protected:
      * err: Array to hold the class error rates
      * data: The dataset to use for predictions
      */
-    void oobPredict(ConfusionMatrix& cm, const Dataset& data) const {
+    template <typename DatasetT>
+    void oobPredict(ConfusionMatrix& cm, const DatasetT& data) const {
         assert(m_data->numClasses() == data.numClasses());
         DoubleArray dist;
+        FtvalArray row;
 
         for (IdArray::const_iterator it = m_oob.begin();
              it != m_oob.end(); ++it) {
-            Dataset::DataSamplePtr d = data.getSample(*it);
-            predict(dist, *d);
-            assert(d->label() != Dataset::NoLabel);
+            predict(dist, DatasetAccess<DatasetT>::sample(data, *it, row));
+            Label y = data.getLabel(*it);
+            assert(y != Dataset::NoLabel);
 
-            cm.inc(d->label(), dist);
+            cm.inc(y, dist);
         }
     }
 
@@ -162,7 +493,8 @@ private:
     /**
      * Default constructor for deserialisation only
      */
-    RFtree() {
+    RFtree():
+        m_maxLeafProb(1) {
     }
     friend class RFbuilder;
 
@@ -195,9 +527,49 @@ private:
      * Root of the tree
      */
     RFnode::Ptr m_root;
+
+    /**
+     * Pool of normalised leaf distributions, NULL if not finalised
+     */
+    LeafPool::Ptr m_pool;
+
+    /**
+     * Largest class probability of any leaf
+     */
+    double m_maxLeafProb;
+
+    /**
+     * The tree in an array layout optimised for prediction
+     */
+    FlatNodeArray m_flat;
 };
 
 
+/**
+ * Loads individual trees of a serialised forest on demand
+ */
+class TreeLoader
+{
+public:
+    typedef RefCountPtr<TreeLoader> Ptr;
+
+    virtual ~TreeLoader() {};
+
+    /**
+     * Load a tree, returns NULL on error. May be called concurrently for
+     * different trees.
+     * n: Index of the tree in the forest
+     */
+    virtual RFtree* load(uint n) = 0;
+};
+
+
+/**
+ * Byte offsets of the trees in a serialised forest
+ */
+typedef std::vector<unsigned long long> OffsetArray;
+
+
 /**
  * A forest of trees
  */
@@ -211,14 +583,123 @@ public:
      * data: The underlying dataset, must remain in scope for the life of the
      *       forest
      * params: Random forest parameters
+     * DatasetT: The dataset type, see RFtree
      */
-    RFforest(const Dataset* data, const RFparameters::Ptr params):
-        m_data(data), m_params(params) {
+    template <typename DatasetT>
+    RFforest(const DatasetT* data, const RFparameters::Ptr params):
+        m_data(data), m_params(params), m_numClasses(0) {
         m_trees.reserve(m_params->numTrees);
         for (uint i = 0; i < m_params->numTrees; ++i) {
             LOG(Log::DEBUG1) << "Building tree " << i;
             m_trees.push_back(new RFtree(data, m_params));
         }
+        finalise();
+    }
+
+    /**
+     * Precompute the quantised and deduplicated leaf distributions used for
+     * prediction. Called automatically after the forest is built or
+     * deserialised. Trees which haven't been loaded yet are added to the
+     * pool when they are loaded.
+     */
+    void finalise() {
+        assert(!m_trees.empty());
+        for (std::vector<RFtree::Ptr>::const_iterator it = m_trees.begin();
+             it != m_trees.end(); ++it) {
+            if (it->get()) {
+                m_numClasses = (*it)->getRoot()->numClasses();
+                break;
+            }
+        }
+        m_pool = new LeafPool(m_numClasses);
+
+        for (std::vector<RFtree::Ptr>::const_iterator it = m_trees.begin();
+             it != m_trees.end(); ++it) {
+            if (it->get()) {
+                (*it)->finalise(m_pool);
+            }
+        }
+        m_pool->compact();
+
+        LOG(Log::DEBUG1) << "Leaf pool: " << m_pool->size()
+                         << " distinct distributions";
+
+        updateVoteBounds();
+    }
+
+    /**
+     * Reorder the trees for early exit prediction by their OOB error rate,
+     * most accurate first, so that the vote is usually decided early. The
+     * trees themselves are moved, so the order is kept when the forest is
+     * saved in either format.
+     */
+    void orderTreesByOob() {
+        std::vector<std::pair<double, uint> > errs(numTrees());
+        DoubleArray err;
+        for (uint i = 0; i < numTrees(); ++i) {
+            errs[i].first = tree(i).oobErrors(err);
+            errs[i].second = i;
+        }
+        std::stable_sort(errs.begin(), errs.end());
+
+        // Every tree has been loaded, so the loader's tree numbers are no
+        // longer needed
+        std::vector<RFtree::Ptr> trees(numTrees());
+        for (uint i = 0; i < numTrees(); ++i) {
+            trees[i] = m_trees[errs[i].second];
+        }
+        m_trees.swap(trees);
+        updateVoteBounds();
+    }
+
+    /**
+     * Prediction of the most likely class, evaluating trees only until the
+     * leading class can no longer be overtaken by the remaining trees.
+     * Trees are evaluated in forest order, see orderTreesByOob().
+     * dist: Array to hold the (partial) class predictions
+     * d: Sample to be predicted, anything with an operator[] returning the
+     *    value of a feature
+     * used: If not NULL set to the number of trees evaluated
+     * Returns the predicted class, the same as the maximum of the
+     * distribution returned by predict()
+     */
+    template <typename SampleT>
+    Label predictEarly(DoubleArray& dist, const SampleT& d,
+                       uint* used = NULL) const {
+        dist.assign(m_numClasses, 0);
+
+        uint k = 0;
+        while (k < numTrees()) {
+            tree(k++).accumulate(&dist[0], d);
+
+            double first = 0, second = 0;
+            for (uint c = 0; c < m_numClasses; ++c) {
+                if (dist[c] > first) {
+                    second = first;
+                    first = dist[c];
+                }
+                else if (dist[c] > second) {
+                    second = dist[c];
+                }
+            }
+
+            if (first - second > m_voteBound[k]) {
+                break;
+            }
+        }
+
+        if (used) {
+            *used = k;
+        }
+        Utils::normalise<DoubleArray>(dist.begin(), dist.end());
+        return getClass_MaxProb(dist);
+    }
+
+    /**
+     * Return the number of classes
+     */
+    uint numClasses() const {
+        return m_numClasses;
     }
 
     /**
@@ -228,25 +709,72 @@ public:
         m_data = data;
         for (std::vector<RFtree::Ptr>::const_iterator it = m_trees.begin();
              it != m_trees.end(); ++it) {
-            (*it)->setDataset(data);
+            if (it->get()) {
+                (*it)->setDataset(data);
+            }
         }
     }
 
+    /**
+     * Return true if every tree has been loaded
+     */
+    bool isLoaded() const {
+        for (uint i = 0; i < numTrees(); ++i) {
+            if (!m_trees[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Load any trees which haven't been loaded yet. Trees of a lazily opened
+     * forest are otherwise loaded on first use, which is not thread safe, so
+     * this must be called before the forest is shared between threads.
+     * nthreads: Number of threads used to parse the trees, 0 to use all
+     *           processors
+     */
+    void loadAll(uint nthreads = 1) const {
+        UintArray missing;
+        for (uint i = 0; i < numTrees(); ++i) {
+            if (!m_trees[i].get()) {
+                missing.push_back(i);
+            }
+        }
+        if (missing.empty()) {
+            return;
+        }
+
+        std::vector<RFtree*> loaded(missing.size());
+        LoadTask task(*m_loader, missing, loaded);
+        ThreadPool pool(nthreads);
+        pool.run(task, missing.size());
+
+        // Leaves are added to the shared pool in order, so the pool is the
+        // same as if the trees were loaded sequentially
+        for (uint k = 0; k < missing.size(); ++k) {
+            add(missing[k], loaded[k]);
+        }
+        m_pool->compact();
+        updateVoteBounds();
+    }
+
     /**
      * Prediction
      * dist: Array to hold the class predictions
      * treeDists: Array of arrays to hold the class predictions from each tree
-     * d: Sample to be predicted
+     * d: Sample to be predicted, anything with an operator[]
      */
+    template <typename SampleT>
     void predict(DoubleArray& dist, std::vector<DoubleArray>& treeDists,
-                 const DataSample& d) const {
+                 const SampleT& d) const {
         treeDists.resize(m_trees.size());
         // Fill with 0
         dist.clear();
-        dist.resize(m_data->numClasses());
+        dist.resize(m_numClasses);
 
         for (uint i = 0; i < m_trees.size(); ++i) {
-            m_trees[i]->predict(treeDists[i], d);
+            tree(i).predict(treeDists[i], d);
             std::transform(dist.begin(), dist.end(), treeDists[i].begin(),
                            dist.begin(), std::plus<double>());
         }
@@ -257,11 +785,32 @@ public:
     /**
      * Prediction
      * dist: Array to hold the class predictions
-     * d: Sample to be predicted
+     * d: Sample to be predicted, anything with an operator[]
+     */
+    template <typename SampleT>
+    void predict(DoubleArray& dist, const SampleT& d) const {
+        dist.resize(m_numClasses);
+        predict(&dist[0], d);
+    }
+
+    /**
+     * Prediction into a caller owned array, accumulating directly from the
+     * leaves without allocating
+     * dist: Array of numClasses() values to hold the class predictions
+     * d: Sample to be predicted, anything with an operator[]
      */
-    void predict(DoubleArray& dist, const DataSample& d) const {
-        std::vector<DoubleArray> treeDists;
-        predict(dist, treeDists, d);
+    template <typename SampleT>
+    void predict(double* dist, const SampleT& d) const {
+        std::fill(dist, dist + m_numClasses, 0);
+
+        for (uint i = 0; i < m_trees.size(); ++i) {
+            tree(i).accumulate(dist, d);
+        }
+
+        double total = std::accumulate(dist, dist + m_numClasses, 0.0);
+        for (uint c = 0; c < m_numClasses; ++c) {
+            dist[c] /= total;
+        }
     }
 
     /**
@@ -277,7 +826,7 @@ public:
         err.resize(m_data->numClasses());
 
         for (uint i = 0; i < numTrees(); ++i) {
-            m_trees[i]->oobErrors(treeErrs[i]);
+            tree(i).oobErrors(treeErrs[i]);
             std::transform(err.begin(), err.end(), treeErrs[i].begin(),
                            err.begin(), std::plus<double>());
         }
@@ -297,39 +846,94 @@ public:
     // TODO: varImp should also return oobErrors since it's calculated anyway
 
     /**
-     * OOB variable importances
+     * OOB variable importances. The importance of a feature in a tree is the
+     * decrease in the mean predicted probability of the true class of the
+     * OOB samples when the values of the feature are permuted among them.
+     * The unpermuted predictions of each tree are only made once, and only
+     * the samples which reach a split on the permuted feature are predicted
+     * again.
      * imp: Array to hold the feature importances
      * treeImps: Array of arrays to hold the feature importances from each tree
+     * nthreads: Number of threads, 0 to use all processors. The results
+     *           don't depend on the number of threads.
      */
-    void varImp(DoubleArray& imp, std::vector<DoubleArray>& treeImps) const {
-        treeImps.resize(numTrees());
-        std::fill(treeImps.begin(), treeImps.end(),
-                  DoubleArray(m_data->numFeatures()));
-
-        // Fill with 0
-        imp.resize(m_data->numFeatures());
-        std::fill(imp.begin(), imp.end(), 0);
-
-        for (uint ftid = 0; ftid < m_data->numFeatures(); ++ftid) {
-            Dataset::Ptr permuted = new PermutedFeatureDataset(*m_data, ftid);
-
-            for (uint i = 0; i < numTrees(); ++i) {
-                treeImps[i][ftid] = m_trees[i]->varImp(*permuted, ftid);
-                imp[ftid] += treeImps[i][ftid];
-            }
+    void varImp(DoubleArray& imp, std::vector<DoubleArray>& treeImps,
+                uint nthreads = 1) const {
+        // Read the feature values directly if the dataset type is known,
+        // since every OOB sample is predicted once per feature
+        if (const SingleMatrixDataset* d =
+            dynamic_cast<const SingleMatrixDataset*>(m_data)) {
+            permutationImportance(imp, treeImps, *d, nthreads);
+        }
+        else if (const DenseRowDataset* d =
+                 dynamic_cast<const DenseRowDataset*>(m_data)) {
+            permutationImportance(imp, treeImps, *d, nthreads);
+        }
+        else if (const MappedDataset* d =
+                 dynamic_cast<const MappedDataset*>(m_data)) {
+            permutationImportance(imp, treeImps, *d, nthreads);
+        }
+        else if (const SparseDataset* d =
+                 dynamic_cast<const SparseDataset*>(m_data)) {
+            permutationImportance(imp, treeImps, *d, nthreads);
+        }
+        else {
+            permutationImportance(imp, treeImps, *m_data, nthreads);
         }
-
-        Utils::normalise<DoubleArray>(imp.begin(), imp.end(), numTrees());
     }
 
     /**
      * OOB variable importances
      * imp: Array to hold the feature importances
-     * treeImps: Array of arrays to hold the feature importances from each tree
+     * nthreads: Number of threads, 0 to use all processors
      */
-    void varImp(DoubleArray& imp) const {
+    void varImp(DoubleArray& imp, uint nthreads = 1) const {
         std::vector<DoubleArray> treeImps;
-        varImp(imp, treeImps);
+        varImp(imp, treeImps, nthreads);
+    }
+
+    /**
+     * OOB variable importances, as varImp() but with the feature values read
+     * through DatasetAccess<DatasetT>
+     * imp: Array to hold the feature importances
+     * treeImps: Array of arrays to hold the feature importances from each tree
+     * data: The dataset the forest was trained on
+     * nthreads: Number of threads, 0 to use all processors
+     */
+    template <typename DatasetT>
+    void permutationImportance(DoubleArray& imp,
+                               std::vector<DoubleArray>& treeImps,
+                               const DatasetT& data, uint nthreads = 1) const {
+        loadAll(nthreads);
+        uint nf = data.numFeatures();
+        treeImps.assign(numTrees(), DoubleArray(nf));
+
+        // Each work item handles a block of features of one tree, with
+        // enough blocks to keep every thread busy
+        ThreadPool pool(nthreads);
+        uint blocks = (4 * pool.size() + numTrees() - 1) / numTrees();
+        blocks = std::max(1u, std::min(blocks, nf));
+
+        // If a tree is split into blocks its OOB samples are indexed once
+        // up front and shared by the blocks, there are then fewer than
+        // 4 trees per thread so keeping every index is cheap
+        std::vector<TreeOob> oobs(blocks > 1? numTrees(): 0);
+        if (!oobs.empty()) {
+            OobTask<DatasetT> task(*this, data, oobs, pool.size());
+            pool.run(task, numTrees());
+        }
+
+        ImportanceTask<DatasetT> task(*this, data,
+                                      Utils::randint(0, RAND_MAX), blocks,
+                                      oobs, treeImps, pool.size());
+        pool.run(task, numTrees() * blocks);
+
+        imp.assign(nf, 0);
+        for (uint i = 0; i < numTrees(); ++i) {
+            std::transform(imp.begin(), imp.end(), treeImps[i].begin(),
+                           imp.begin(), std::plus<double>());
+        }
+        Utils::normalise<DoubleArray>(imp.begin(), imp.end(), numTrees());
     }
 
     /**
@@ -340,38 +944,357 @@ public:
     }
 
     /**
-     * Get a tree in the forest
+     * Get the parameters
+     */
+    RFparameters::Ptr getParams() const {
+        return m_params;
+    }
+
+    /**
+     * Get the pool of normalised leaf distributions
+     */
+    LeafPool::Ptr getLeafPool() const {
+        return m_pool;
+    }
+
+    /**
+     * Get a tree in the forest, loading it if necessary
      * n: Index of the tree
      */
     RFtree::Ptr getTree(uint n) const {
-        assert(n < m_trees.size());
+        tree(n);
         return m_trees[n];
     }
 
     /**
      * Save this object
+     * oob: Whether to save the OOB samples of each tree, see
+     *      RFtree::serialise()
      */
-    void serialise(std::ostream& os, uint level, uint i) const {
-        os << in(i) << "RFforest{\n"
-           << in(i) << "data " << "[0]" << "\n"
-           << in(i) << "params\n";
-        m_params->serialise(os, level, i + 1);
-        os << in(i) << "trees " << "[" << m_trees.size() << "]\n";
-        for (std::vector<RFtree::Ptr>::const_iterator it =
-                 m_trees.begin(); it != m_trees.end(); ++it) {
-            (*it)->serialise(os, level, i + 1);
+    void serialise(std::ostream& os, uint level, uint i, bool oob = true)
+        const {
+        serialiseHeader(os, level, i);
+        for (uint n = 0; n < numTrees(); ++n) {
+            tree(n).serialise(os, level, i + 1, oob);
         }
         os << in(i) << "}RFforest\n";
     }
 
+    /**
+     * Save this object followed by an index of the byte offset of each tree,
+     * so that RFbuilder::openForest() can load trees individually. The
+     * offsets are relative to the start of the output, and the index is
+     * located using a fixed size footer at the end of the output. Readers
+     * which don't use the index ignore it.
+     * oob: Whether to save the OOB samples of each tree
+     * nthreads: Number of threads used to serialise the trees, 0 to use all
+     *           processors
+     */
+    void serialiseIndexed(std::ostream& os, uint level, bool oob = true,
+                          uint nthreads = 1) const {
+        loadAll(nthreads);
+        OffsetArray offsets(numTrees());
+
+        std::ostringstream oss;
+        serialiseHeader(oss, level, 0);
+        unsigned long long pos = oss.str().size();
+        os << oss.str();
+
+        // Trees are serialised in parallel into separate buffers, a few per
+        // thread at a time to limit the memory used
+        ThreadPool pool(nthreads);
+        uint batch = pool.size() * 4;
+        std::vector<std::string> texts;
+
+        for (uint first = 0; first < numTrees(); first += batch) {
+            uint n = std::min(batch, numTrees() - first);
+            texts.assign(n, std::string());
+            SerialiseTask task(*this, first, level, oob, texts);
+            pool.run(task, n);
+
+            for (uint k = 0; k < n; ++k) {
+                offsets[first + k] = pos;
+                pos += texts[k].size();
+                os << texts[k];
+            }
+        }
+        oss.str("");
+        oss << "}RFforest\n";
+        pos += oss.str().size();
+        os << oss.str();
+
+        os << "RFindex{\n"
+           << "numClasses " << m_numClasses << "\n"
+           << "trees " << arrayToString(offsets) << "\n"
+           << "}RFindex\n";
+
+        char footer[IndexFooterSize + 1];
+        std::snprintf(footer, sizeof(footer), "indexOffset %020llu\n", pos);
+        os << footer;
+    }
+
+    /**
+     * Size of the footer written by serialiseIndexed()
+     */
+    static const uint IndexFooterSize = 33;
+
 private:
     /**
      * Default constructor for deserialisation only
      */
-    RFforest() {
+    RFforest():
+        m_data(NULL), m_numClasses(0) {
     }
     friend class RFbuilder;
 
+    /**
+     * Get a tree, loading it if necessary
+     */
+    const RFtree& tree(uint n) const {
+        assert(n < m_trees.size());
+        if (!m_trees[n]) {
+            load(n);
+        }
+        return *m_trees[n].get();
+    }
+
+    /**
+     * Load a tree of a lazily opened forest. The bounds used by
+     * predictEarly() aren't updated until loadAll(), the bound for an
+     * unloaded tree is always valid.
+     */
+    void load(uint n) const {
+        assert(m_loader.get());
+        add(n, m_loader->load(n));
+    }
+
+    /**
+     * Add a loaded tree to the forest. The tree index is checked when the
+     * forest is opened, so the loader only fails if the file has been
+     * changed since.
+     * n: Index of the tree
+     * t: The tree
+     */
+    void add(uint n, RFtree* t) const {
+        if (!t) {
+            LOG(Log::ERROR) << "Failed to load tree " << n;
+        }
+        assert(t);
+        if (m_data) {
+            t->setDataset(m_data);
+        }
+        t->finalise(m_pool);
+        m_trees[n] = t;
+    }
+
+    /**
+     * Loads one tree per work item
+     */
+    class LoadTask: public ParallelTask
+    {
+    public:
+        LoadTask(TreeLoader& loader, const UintArray& trees,
+                 std::vector<RFtree*>& loaded):
+            m_loader(loader), m_treeIds(trees), m_loaded(loaded) {
+        }
+
+        virtual void run(uint n, uint) {
+            m_loaded[n] = m_loader.load(m_treeIds[n]);
+        }
+
+    private:
+        TreeLoader& m_loader;
+        const UintArray& m_treeIds;
+        std::vector<RFtree*>& m_loaded;
+    };
+
+    /**
+     * Serialises one tree per work item
+     */
+    class SerialiseTask: public ParallelTask
+    {
+    public:
+        SerialiseTask(const RFforest& forest, uint first, uint level,
+                      bool oob, std::vector<std::string>& texts):
+            m_forest(forest), m_first(first), m_level(level), m_oob(oob),
+            m_texts(texts) {
+        }
+
+        virtual void run(uint n, uint) {
+            std::ostringstream oss;
+            m_forest.tree(m_first + n).serialise(oss, m_level, 1, m_oob);
+            m_texts[n] = oss.str();
+        }
+
+    private:
+        const RFforest& m_forest;
+        uint m_first;
+        uint m_level;
+        bool m_oob;
+        std::vector<std::string>& m_texts;
+    };
+
+    /**
+     * The OOB samples of a tree prepared for permutation importance
+     */
+    struct TreeOob
+    {
+        /**
+         * Index of the OOB samples, if indexed
+         */
+        RFtree::OobIndex index;
+
+        /**
+         * False if the tree can't be flattened, in which case every sample
+         * is predicted for every feature
+         */
+        bool indexed;
+
+        /**
+         * The unpermuted OOB score, only needed if not indexed
+         */
+        double baseline;
+
+        /**
+         * Prepare the OOB samples of a tree
+         * tree: The tree, must have OOB samples
+         * data: The dataset
+         * row, dist: Scratch buffers
+         */
+        template <typename DatasetT>
+        void prepare(const RFtree& tree, const DatasetT& data,
+                     FtvalArray& row, DoubleArray& dist) {
+            indexed = tree.indexOob(index, data, row);
+            baseline = indexed? 0: tree.oobScore(data, row, dist);
+        }
+    };
+
+    /**
+     * Prepares the OOB samples of one tree per work item
+     */
+    template <typename DatasetT>
+    class OobTask: public ParallelTask
+    {
+    public:
+        OobTask(const RFforest& forest, const DatasetT& data,
+                std::vector<TreeOob>& oobs, uint nthreads):
+            m_forest(forest), m_data(data), m_oobs(oobs), m_rows(nthreads),
+            m_dists(nthreads) {
+        }
+
+        virtual void run(uint n, uint thread) {
+            const RFtree& tree = m_forest.tree(n);
+            if (tree.numOob() > 0) {
+                m_oobs[n].prepare(tree, m_data, m_rows[thread],
+                                  m_dists[thread]);
+            }
+        }
+
+    private:
+        const RFforest& m_forest;
+        const DatasetT& m_data;
+        std::vector<TreeOob>& m_oobs;
+        std::vector<FtvalArray> m_rows;
+        std::vector<DoubleArray> m_dists;
+    };
+
+    /**
+     * Calculates the importances of a block of features in one tree per
+     * work item
+     */
+    template <typename DatasetT>
+    class ImportanceTask: public ParallelTask
+    {
+    public:
+        /**
+         * oobs: The prepared OOB samples of each tree, see OobTask, or empty
+         *       to prepare them in each work item, if there is one block
+         *       per tree
+         */
+        ImportanceTask(const RFforest& forest, const DatasetT& data,
+                       unsigned long long seed, uint blocks,
+                       const std::vector<TreeOob>& oobs,
+                       std::vector<DoubleArray>& treeImps, uint nthreads):
+            m_forest(forest), m_data(data), m_seed(seed), m_blocks(blocks),
+            m_oobs(oobs), m_treeImps(treeImps), m_scratch(nthreads) {
+            assert(blocks == 1 || oobs.size() == forest.numTrees());
+        }
+
+        virtual void run(uint n, uint thread) {
+            Scratch& s = m_scratch[thread];
+            uint t = n / m_blocks;
+            uint nf = m_data.numFeatures();
+            uint from = n % m_blocks * nf / m_blocks;
+            uint to = (n % m_blocks + 1) * nf / m_blocks;
+
+            const RFtree& tree = m_forest.tree(t);
+            if (tree.numOob() == 0) {
+                return;
+            }
+
+            const TreeOob* oob = &s.oob;
+            if (m_oobs.empty()) {
+                s.oob.prepare(tree, m_data, s.row, s.dist);
+            }
+            else {
+                oob = &m_oobs[t];
+            }
+            bool indexed = oob->indexed;
+
+            for (uint ftid = from; ftid < to; ++ftid) {
+                // Permuting a feature which isn't used can't change any
+                // prediction
+                if (indexed && !oob->index.splitsOn(ftid)) {
+                    continue;
+                }
+
+                // Each tree and feature has its own random sequence, so the
+                // results don't depend on how the work is split
+                tree.selectOob(s.values, m_data, ftid);
+                Random rng(m_seed, (unsigned long long)t * nf + ftid);
+                std::random_shuffle(s.values.begin(), s.values.end(), rng);
+
+                double loss = indexed?
+                    tree.permutedOobLoss(oob->index, m_data, ftid, s.values,
+                                         s.row):
+                    oob->baseline - tree.oobScore(m_data, ftid, s.values,
+                                                  s.row, s.dist);
+                m_treeImps[t][ftid] = loss / tree.numOob();
+            }
+        }
+
+    private:
+        /**
+         * Per-thread buffers
+         */
+        struct Scratch
+        {
+            TreeOob oob;
+            FtvalArray values;
+            FtvalArray row;
+            DoubleArray dist;
+        };
+
+        const RFforest& m_forest;
+        const DatasetT& m_data;
+        unsigned long long m_seed;
+        uint m_blocks;
+        const std::vector<TreeOob>& m_oobs;
+        std::vector<DoubleArray>& m_treeImps;
+        std::vector<Scratch> m_scratch;
+    };
+
+    /**
+     * Write everything before the trees
+     */
+    void serialiseHeader(std::ostream& os, uint level, uint i) const {
+        os << in(i) << "RFforest{\n"
+           << in(i) << "data " << "[0]" << "\n"
+           << in(i) << "params\n";
+        m_params->serialise(os, level, i + 1);
+        os << in(i) << "trees " << "[" << m_trees.size() << "]\n";
+    }
+
     /**
      * The underlying dataset
      */
@@ -383,9 +1306,43 @@ private:
     RFparameters::Ptr m_params;
 
     /**
-     * The array of trees
+     * The array of trees, NULL if a tree hasn't been loaded yet
      */
-    std::vector<RFtree::Ptr> m_trees;
+    mutable std::vector<RFtree::Ptr> m_trees;
+
+    /**
+     * Loads trees on first use, NULL if all trees were loaded up front
+     */
+    TreeLoader::Ptr m_loader;
+
+    /**
+     * Number of classes
+     */
+    uint m_numClasses;
+
+    /**
+     * Pool of normalised leaf distributions shared by all trees
+     */
+    LeafPool::Ptr m_pool;
+
+    /**
+     * m_voteBound[k]: Largest total vote which can be added to any class by
+     * the trees k..numTrees()-1
+     */
+    mutable DoubleArray m_voteBound;
+
+    /**
+     * Update the bounds on the votes of the remaining trees, an unloaded
+     * tree can contribute up to 1
+     */
+    void updateVoteBounds() const {
+        m_voteBound.assign(numTrees() + 1, 0);
+        for (uint k = numTrees(); k > 0; --k) {
+            const RFtree::Ptr& t = m_trees[k - 1];
+            m_voteBound[k - 1] = m_voteBound[k] +
+                (t.get()? t->maxLeafProbability(): 1);
+        }
+    }
 };
 
 
@@ -158,6 +158,47 @@ public:
 };
 
 
+/**
+ * A pseudo random number generator with its own state (SplitMix64), so work
+ * which is split between threads can use random sequences which don't
+ * depend on the order in which the work is done
+ */
+class Random
+{
+public:
+    /**
+     * Create a generator
+     * seed: The seed
+     * stream: Combined with the seed, so that each work item can have an
+     *         independent sequence
+     */
+    Random(unsigned long long seed, unsigned long long stream = 0):
+        m_state(seed ^ (stream * 0x9e3779b97f4a7c15ull)) {
+    }
+
+    /**
+     * Return the next 64 random bits
+     */
+    unsigned long long next() {
+        unsigned long long z = (m_state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * Return a random integer in [0, n), so this can be passed to
+     * std::random_shuffle
+     */
+    long operator()(long n) {
+        return next() % n;
+    }
+
+private:
+    unsigned long long m_state;
+};
+
+
 /**
  * A confusion matrix
  */
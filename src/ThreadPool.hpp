@@ -0,0 +1,245 @@
+/**
+ * A simple pool of worker threads
+ */
+#ifndef YARF_THREADPOOL_HPP
+#define YARF_THREADPOOL_HPP
+
+#include <cassert>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include "RFtypes.hpp"
+
+
+/**
+ * Interface to a task consisting of many independent work items
+ */
+class ParallelTask
+{
+public:
+    virtual ~ParallelTask() {};
+
+    /**
+     * Process a single work item, may be called concurrently from multiple
+     * threads for different items
+     * n: The index of the work item
+     * thread: The index of the calling thread, in [0, ThreadPool::size())
+     */
+    virtual void run(uint n, uint thread) = 0;
+};
+
+
+/**
+ * A fixed set of worker threads which process the items of a ParallelTask.
+ * The thread calling run() also processes items, as thread 0.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * Create a thread pool
+     * nthreads: The total number of threads including the calling thread,
+     *           if 0 use the number of online processors
+     */
+    ThreadPool(uint nthreads = 0):
+        m_task(NULL), m_n(0), m_next(0), m_busy(0), m_generation(0),
+        m_stop(false) {
+        if (nthreads == 0) {
+            nthreads = hardwareThreads();
+        }
+
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_wake, NULL);
+        pthread_cond_init(&m_done, NULL);
+
+        m_workers.resize(nthreads - 1);
+        m_args.resize(nthreads - 1);
+        for (uint t = 0; t < m_workers.size(); ++t) {
+            m_args[t].pool = this;
+            m_args[t].thread = t + 1;
+            pthread_create(&m_workers[t], NULL, worker, &m_args[t]);
+        }
+    }
+
+    ~ThreadPool() {
+        pthread_mutex_lock(&m_mutex);
+        m_stop = true;
+        pthread_cond_broadcast(&m_wake);
+        pthread_mutex_unlock(&m_mutex);
+
+        for (uint t = 0; t < m_workers.size(); ++t) {
+            pthread_join(m_workers[t], NULL);
+        }
+
+        pthread_cond_destroy(&m_done);
+        pthread_cond_destroy(&m_wake);
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    /**
+     * Return the total number of threads, including the calling thread
+     */
+    uint size() const {
+        return m_workers.size() + 1;
+    }
+
+    /**
+     * Process all items of a task, returns when all items are complete.
+     * Must not be called concurrently.
+     * task: The task
+     * n: Number of work items
+     */
+    void run(ParallelTask& task, uint n) {
+        pthread_mutex_lock(&m_mutex);
+        assert(m_busy == 0);
+        m_task = &task;
+        m_n = n;
+        m_next = 0;
+        m_busy = m_workers.size();
+        ++m_generation;
+        pthread_cond_broadcast(&m_wake);
+        pthread_mutex_unlock(&m_mutex);
+
+        process(task, 0);
+
+        pthread_mutex_lock(&m_mutex);
+        while (m_busy > 0) {
+            pthread_cond_wait(&m_done, &m_mutex);
+        }
+        m_task = NULL;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * Return the number of online processors
+     */
+    static uint hardwareThreads() {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n > 0? n: 1;
+    }
+
+protected:
+    struct WorkerArg
+    {
+        ThreadPool* pool;
+        uint thread;
+    };
+
+    /**
+     * Take the next unprocessed item, returns false if there are none left
+     */
+    bool take(uint& n) {
+        pthread_mutex_lock(&m_mutex);
+        bool b = m_next < m_n;
+        if (b) {
+            n = m_next++;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return b;
+    }
+
+    /**
+     * Process items until there are none left
+     */
+    void process(ParallelTask& task, uint thread) {
+        uint n;
+        while (take(n)) {
+            task.run(n, thread);
+        }
+    }
+
+    /**
+     * Worker thread main loop
+     */
+    static void* worker(void* arg) {
+        ThreadPool* pool = static_cast<WorkerArg*>(arg)->pool;
+        uint thread = static_cast<WorkerArg*>(arg)->thread;
+        uint seen = 0;
+
+        pthread_mutex_lock(&pool->m_mutex);
+        while (true) {
+            while (!pool->m_stop && pool->m_generation == seen) {
+                pthread_cond_wait(&pool->m_wake, &pool->m_mutex);
+            }
+            if (pool->m_stop) {
+                break;
+            }
+            seen = pool->m_generation;
+            ParallelTask* task = pool->m_task;
+
+            pthread_mutex_unlock(&pool->m_mutex);
+            pool->process(*task, thread);
+            pthread_mutex_lock(&pool->m_mutex);
+
+            if (--pool->m_busy == 0) {
+                pthread_cond_signal(&pool->m_done);
+            }
+        }
+        pthread_mutex_unlock(&pool->m_mutex);
+
+        return NULL;
+    }
+
+private:
+    // Not copyable
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    /**
+     * The worker threads
+     */
+    std::vector<pthread_t> m_workers;
+
+    /**
+     * Arguments passed to each worker thread
+     */
+    std::vector<WorkerArg> m_args;
+
+    /**
+     * Protects all of the following members
+     */
+    pthread_mutex_t m_mutex;
+
+    /**
+     * Signalled when a new task is available or the pool is stopping
+     */
+    pthread_cond_t m_wake;
+
+    /**
+     * Signalled when the last worker finishes the current task
+     */
+    pthread_cond_t m_done;
+
+    /**
+     * The current task
+     */
+    ParallelTask* m_task;
+
+    /**
+     * Number of items in the current task
+     */
+    uint m_n;
+
+    /**
+     * Index of the next unprocessed item
+     */
+    uint m_next;
+
+    /**
+     * Number of workers which haven't finished the current task
+     */
+    uint m_busy;
+
+    /**
+     * Incremented for each new task
+     */
+    uint m_generation;
+
+    /**
+     * Set when the pool is being destroyed
+     */
+    bool m_stop;
+};
+
+
+#endif // YARF_THREADPOOL_HPP
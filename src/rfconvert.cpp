@@ -0,0 +1,144 @@
+/**
+ * Convert random forest models between the text and binary formats
+ *
+ * Usage: rfconvert [-z] input output
+ *        rfconvert -d [-c columns] input.csv output
+ * A text model is converted to binary and vice versa, the input format is
+ * detected automatically. -z compresses the trees of a binary model.
+ * -d converts a CSV dataset, with the class label in the last column, to
+ * the binary dataset format which can be memory mapped. -c gives a comma
+ * separated list of the columns holding categorical features.
+ */
+#include "RFtree.hpp"
+#include "RFbinary.hpp"
+#include "RFdeserialise.hpp"
+#include "DataIO.hpp"
+#include "MappedDataset.hpp"
+#include "Logger.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+
+int main(int argc, char* argv[])
+{
+    Log::reportingLevel() = Log::INFO;
+
+    const char* prog = argv[0];
+    bool compress = argc > 1 && std::strcmp(argv[1], "-z") == 0;
+    bool dataset = argc > 1 && std::strcmp(argv[1], "-d") == 0;
+    if (compress || dataset)
+    {
+        --argc;
+        ++argv;
+    }
+
+    UintArray categorical;
+    if (dataset && argc > 2 && std::strcmp(argv[1], "-c") == 0)
+    {
+        if (!CsvDatasetReader::parseColumns(argv[2], categorical))
+        {
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 3)
+    {
+        std::cerr << "Usage: " << prog << " [-z] input output\n"
+                  << "       " << prog << " -d [-c columns] input.csv output"
+                  << std::endl;
+        return 1;
+    }
+
+    if (dataset)
+    {
+        Dataset::Ptr data = CsvDatasetReader::read(argv[1], -1, 0,
+                                                   categorical);
+        if (!data)
+        {
+            return 1;
+        }
+
+        std::ofstream os(argv[2], std::ios::binary);
+        if (!os || !MappedDataset::write(os, *data))
+        {
+            LOG(Log::ERROR) << "Failed to write " << argv[2];
+            return 1;
+        }
+        LOG(Log::INFO) << "Converted CSV dataset to binary";
+        return 0;
+    }
+
+    std::ifstream is(argv[1], std::ios::binary);
+    if (!is)
+    {
+        LOG(Log::ERROR) << "Unable to open " << argv[1];
+        return 1;
+    }
+
+    char magic[8] = {0};
+    is.read(magic, sizeof(magic));
+    is.clear();
+    is.seekg(0);
+
+    // The whole input is read before the output is opened, so converting a
+    // model in place doesn't truncate it first
+    bool binary = FlatForest::isBinary(magic, is.gcount());
+    RFforest::Ptr forest;
+    FlatForest::Ptr flat;
+    if (binary)
+    {
+        flat = FlatForest::read(is);
+        if (!flat)
+        {
+            return 1;
+        }
+
+        Deserialiser ds(is);
+        RFbuilder builder(ds);
+        forest = builder.dRFforest(*flat);
+    }
+    else
+    {
+        is.close();
+        forest = RFbuilder::openForest(argv[1], NULL, false, 0);
+        if (!forest)
+        {
+            return 1;
+        }
+
+        flat = FlatForest::flatten(*forest);
+        if (!flat)
+        {
+            return 1;
+        }
+    }
+
+    std::ofstream os(argv[2], std::ios::binary);
+    if (!os)
+    {
+        LOG(Log::ERROR) << "Unable to open " << argv[2];
+        return 1;
+    }
+
+    if (binary)
+    {
+        forest->serialiseIndexed(os, 0, true, 0);
+        LOG(Log::INFO) << "Converted binary model to text";
+    }
+    else
+    {
+        flat->write(os, compress);
+        LOG(Log::INFO) << "Converted text model to binary";
+    }
+
+    if (!os)
+    {
+        LOG(Log::ERROR) << "Failed to write " << argv[2];
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,719 @@
+/**
+ * Prediction server for the random forest
+ *
+ * Loads a forest once, then reads feature vectors (one sample per
+ * line, comma separated) from clients connected to a Unix domain socket, or
+ * from stdin if no socket is given. Requests are coalesced into micro-batches
+ * which are scored in parallel, and each client receives one line per
+ * request, in order, containing the predicted class followed by the class
+ * distribution.
+ *
+ * Binary models are memory mapped and used in place, so that startup is
+ * immediate and several server processes using the same model share a single
+ * copy of it in the page cache. Text models are converted after loading.
+ *
+ * Each client has its own reader and writer thread, so a client which is slow
+ * to read its replies only holds up itself. A client stops being read while
+ * max-queue of its requests are waiting to be scored or written, and is
+ * disconnected if a write stalls for WriteTimeout seconds. Clients beyond
+ * max-clients are refused.
+ *
+ * Usage: rfserver model [socket|-] [max-batch] [max-latency-us] [threads]
+ *                 [max-clients] [max-queue]
+ */
+#include "Dataset.hpp"
+#include "RFtree.hpp"
+#include "RFbinary.hpp"
+#include "RFdeserialise.hpp"
+#include "ThreadPool.hpp"
+#include "Logger.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+/**
+ * A client, either a socket connection or stdin/stdout. The counts, flags and
+ * replies are protected by the server mutex.
+ */
+struct Connection
+{
+    Connection(int in, int out):
+        in(in), out(out), pending(0), unwritten(0), closed(false),
+        failed(false), numReplies(0) {
+        pthread_cond_init(&writable, NULL);
+        pthread_cond_init(&space, NULL);
+    }
+
+    ~Connection() {
+        pthread_cond_destroy(&space);
+        pthread_cond_destroy(&writable);
+    }
+
+    /**
+     * File descriptors for reading requests and writing replies
+     */
+    int in;
+    int out;
+
+    /**
+     * Number of requests which haven't been scored yet
+     */
+    uint pending;
+
+    /**
+     * Number of requests whose replies haven't been written yet
+     */
+    uint unwritten;
+
+    /**
+     * Set when the client has stopped sending requests
+     */
+    bool closed;
+
+    /**
+     * Set if a write failed, further replies are discarded
+     */
+    bool failed;
+
+    /**
+     * Replies waiting to be written, and how many there are
+     */
+    std::string replies;
+    uint numReplies;
+
+    /**
+     * Signalled when replies are added, or when the client has closed
+     */
+    pthread_cond_t writable;
+
+    /**
+     * Signalled when replies have been written
+     */
+    pthread_cond_t space;
+};
+
+
+/**
+ * A single sample to be predicted
+ */
+struct Request
+{
+    Connection* conn;
+    FtvalArray x;
+
+    /**
+     * When the request was read
+     */
+    timeval arrival;
+
+    /**
+     * Error message if the request couldn't be parsed
+     */
+    std::string error;
+};
+
+
+/**
+ * Queues requests from all clients and scores them in micro-batches
+ */
+class BatchServer
+{
+public:
+    /**
+     * Seconds a write to a client may block before it's disconnected
+     */
+    static const uint WriteTimeout = 10;
+
+    /**
+     * forest: The forest
+     * maxBatch: Maximum number of requests in a batch
+     * maxLatency: Maximum time in microseconds the first request of a batch
+     *             waits for others to arrive
+     * nthreads: Number of scoring threads, 0 to use all processors
+     * maxClients: Maximum number of connected clients
+     * maxQueue: Maximum number of requests waiting to be scored, and of
+     *           unwritten replies of each client
+     */
+    BatchServer(const FlatForest& forest, uint maxBatch, uint maxLatency,
+                uint nthreads, uint maxClients, uint maxQueue):
+        m_forest(forest), m_maxBatch(maxBatch), m_maxLatency(maxLatency),
+        m_pool(nthreads), m_numFeatures(forest.numFeatures()),
+        m_maxClients(maxClients), m_maxQueue(maxQueue), m_numClients(0),
+        m_stopping(false) {
+        pthread_mutex_init(&m_mutex, NULL);
+        pthread_cond_init(&m_ready, NULL);
+        pthread_cond_init(&m_space, NULL);
+    }
+
+    ~BatchServer() {
+        pthread_cond_destroy(&m_space);
+        pthread_cond_destroy(&m_ready);
+        pthread_mutex_destroy(&m_mutex);
+    }
+
+    /**
+     * Reserve a place for a new client, returns false if there are already
+     * the maximum number of clients
+     */
+    bool admit() {
+        pthread_mutex_lock(&m_mutex);
+        bool ok = m_numClients < m_maxClients;
+        if (ok) {
+            ++m_numClients;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return ok;
+    }
+
+    /**
+     * Release the place of a client which has disconnected
+     */
+    void leave() {
+        pthread_mutex_lock(&m_mutex);
+        assert(m_numClients > 0);
+        --m_numClients;
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * Read requests from a client until it disconnects or a write to it
+     * fails, and return once all replies have been written or discarded.
+     * The file descriptors are left open.
+     */
+    void serveConnection(Connection* conn) {
+        WriterArg arg = {this, conn};
+        pthread_t writer;
+        pthread_create(&writer, NULL, runWriter, &arg);
+
+        std::string buf;
+        char chunk[65536];
+        ssize_t n;
+        bool ok = true;
+
+        while (ok && (n = read(conn->in, chunk, sizeof(chunk))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            buf.append(chunk, n);
+
+            size_t p = 0, q;
+            while (ok && (q = buf.find('\n', p)) != std::string::npos) {
+                ok = enqueue(conn, buf.c_str() + p, buf.c_str() + q);
+                p = q + 1;
+            }
+            buf.erase(0, p);
+        }
+        if (ok && !buf.empty()) {
+            enqueue(conn, buf.c_str(), buf.c_str() + buf.size());
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        conn->closed = true;
+        pthread_cond_signal(&conn->writable);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(writer, NULL);
+    }
+
+    /**
+     * Score batches of requests until stop() is called and the queue is
+     * empty
+     */
+    void run() {
+        std::vector<Request*> batch;
+        DoubleArray dists;
+        uint ncls = m_forest.numClasses();
+
+        while (takeBatch(batch)) {
+            dists.resize(batch.size() * ncls);
+            ScoreTask task(*this, batch, dists);
+            m_pool.run(task, batch.size());
+
+            reply(batch, dists);
+        }
+    }
+
+    /**
+     * Make run() return once the queued requests have been scored
+     */
+    void stop() {
+        pthread_mutex_lock(&m_mutex);
+        m_stopping = true;
+        pthread_cond_signal(&m_ready);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * Write a whole string to a file descriptor, returns false if the write
+     * fails or times out
+     */
+    static bool writeAll(int fd, const std::string& s) {
+        size_t p = 0;
+        while (p < s.size()) {
+            ssize_t n = write(fd, s.c_str() + p, s.size() - p);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += n;
+        }
+        return true;
+    }
+
+protected:
+    /**
+     * Scores one request per work item
+     */
+    class ScoreTask: public ParallelTask
+    {
+    public:
+        ScoreTask(const BatchServer& server,
+                  const std::vector<Request*>& batch, DoubleArray& dists):
+            m_server(server), m_batch(batch), m_dists(dists) {
+        }
+
+        virtual void run(uint n, uint) {
+            const Request& r = *m_batch[n];
+            if (r.error.empty()) {
+                m_server.m_forest.predict(
+                    &m_dists[n * m_server.m_forest.numClasses()], &r.x[0]);
+            }
+        }
+
+    private:
+        const BatchServer& m_server;
+        const std::vector<Request*>& m_batch;
+        DoubleArray& m_dists;
+    };
+
+    struct WriterArg
+    {
+        BatchServer* server;
+        Connection* conn;
+    };
+
+    static void* runWriter(void* arg) {
+        WriterArg* a = static_cast<WriterArg*>(arg);
+        a->server->writeReplies(a->conn);
+        return NULL;
+    }
+
+    /**
+     * Parse a request and add it to the queue, waiting while the queue or
+     * the client's unwritten replies are full
+     * Returns false if the client has failed and should no longer be read
+     */
+    bool enqueue(Connection* conn, const char* p, const char* end) {
+        Request* r = new Request;
+        r->conn = conn;
+
+        std::string line(p, end);
+        const char* s = line.c_str();
+        while (*s) {
+            char* q;
+            double x = std::strtod(s, &q);
+            if (q == s) {
+                r->error = "unable to parse feature value";
+                break;
+            }
+            r->x.push_back(x);
+            s = q + std::strspn(q, ", \t\r");
+        }
+        if (r->error.empty() && r->x.size() < m_numFeatures) {
+            r->error = "expected at least " + Utils::toString(m_numFeatures)
+                + " features, found " + Utils::toString(r->x.size());
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        while (!conn->failed && conn->unwritten >= m_maxQueue) {
+            pthread_cond_wait(&conn->space, &m_mutex);
+        }
+        while (!conn->failed && m_queue.size() >= m_maxQueue) {
+            pthread_cond_wait(&m_space, &m_mutex);
+        }
+        if (conn->failed) {
+            pthread_mutex_unlock(&m_mutex);
+            delete r;
+            return false;
+        }
+
+        // The latency is measured from when the request could be queued
+        gettimeofday(&r->arrival, NULL);
+        ++conn->pending;
+        ++conn->unwritten;
+        m_queue.push_back(r);
+        if (m_queue.size() == 1 || m_queue.size() >= m_maxBatch) {
+            pthread_cond_signal(&m_ready);
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return true;
+    }
+
+    /**
+     * Wait for the first request, then until the maximum latency after it
+     * arrived or until a full batch is available
+     * Returns false if the server is stopping and there are no requests
+     */
+    bool takeBatch(std::vector<Request*>& batch) {
+        batch.clear();
+
+        pthread_mutex_lock(&m_mutex);
+        while (m_queue.empty() && !m_stopping) {
+            pthread_cond_wait(&m_ready, &m_mutex);
+        }
+        if (m_queue.empty()) {
+            pthread_mutex_unlock(&m_mutex);
+            return false;
+        }
+
+        timespec deadline = after(m_queue.front()->arrival, m_maxLatency);
+        while (m_queue.size() < m_maxBatch && !m_stopping &&
+               !passed(deadline)) {
+            if (pthread_cond_timedwait(&m_ready, &m_mutex, &deadline) ==
+                ETIMEDOUT) {
+                break;
+            }
+        }
+
+        while (!m_queue.empty() && batch.size() < m_maxBatch) {
+            batch.push_back(m_queue.front());
+            m_queue.pop_front();
+        }
+        pthread_cond_broadcast(&m_space);
+        pthread_mutex_unlock(&m_mutex);
+        return true;
+    }
+
+    /**
+     * Format the replies to a batch and pass them to the clients' writers,
+     * in order
+     */
+    void reply(const std::vector<Request*>& batch, const DoubleArray& dists) {
+        uint ncls = m_forest.numClasses();
+        std::vector<std::string> texts(batch.size());
+
+        for (uint n = 0; n < batch.size(); ++n) {
+            const Request* r = batch[n];
+            std::string& out = texts[n];
+
+            if (!r->error.empty()) {
+                out = "error: " + r->error + "\n";
+            }
+            else {
+                const double* dist = &dists[n * ncls];
+                uint label = 0;
+                for (uint c = 0; c < ncls; ++c) {
+                    if (dist[c] >= dist[label]) {
+                        label = c;
+                    }
+                }
+
+                char s[32];
+                std::snprintf(s, sizeof(s), "%u", label);
+                out += s;
+                for (uint c = 0; c < ncls; ++c) {
+                    std::snprintf(s, sizeof(s), ",%.6g", dist[c]);
+                    out += s;
+                }
+                out += "\n";
+            }
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        for (uint n = 0; n < batch.size(); ++n) {
+            Connection* conn = batch[n]->conn;
+            conn->replies += texts[n];
+            ++conn->numReplies;
+            --conn->pending;
+            pthread_cond_signal(&conn->writable);
+            delete batch[n];
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * Write the replies of a client until it has closed and every reply has
+     * been written. The batching thread never writes, so a client which
+     * doesn't read its replies only blocks this thread, and it's
+     * disconnected once a write has stalled for WriteTimeout.
+     */
+    void writeReplies(Connection* conn) {
+        if (conn->out != STDOUT_FILENO) {
+            timeval timeout = {WriteTimeout, 0};
+            setsockopt(conn->out, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                       sizeof(timeout));
+        }
+
+        std::string out;
+        pthread_mutex_lock(&m_mutex);
+        while (true) {
+            while (conn->replies.empty() &&
+                   !(conn->closed && conn->unwritten == 0)) {
+                pthread_cond_wait(&conn->writable, &m_mutex);
+            }
+            if (conn->replies.empty()) {
+                break;
+            }
+
+            out.swap(conn->replies);
+            uint k = conn->numReplies;
+            conn->numReplies = 0;
+            bool failed = conn->failed;
+            pthread_mutex_unlock(&m_mutex);
+
+            if (!failed && !writeAll(conn->out, out)) {
+                LOG(Log::WARNING) << "Write to client failed, disconnecting";
+                failed = true;
+                if (conn->in != STDIN_FILENO) {
+                    // Wakes the reader if it's waiting for requests
+                    shutdown(conn->in, SHUT_RDWR);
+                }
+            }
+            out.clear();
+
+            pthread_mutex_lock(&m_mutex);
+            conn->failed = conn->failed || failed;
+            conn->unwritten -= k;
+            pthread_cond_signal(&conn->space);
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * Get the absolute time a number of microseconds after another
+     */
+    static timespec after(const timeval& start, uint us) {
+        unsigned long long ns =
+            (start.tv_usec + (unsigned long long)us) * 1000;
+        timespec t;
+        t.tv_sec = start.tv_sec + ns / 1000000000ull;
+        t.tv_nsec = ns % 1000000000ull;
+        return t;
+    }
+
+    /**
+     * Check whether an absolute time is now or in the past
+     */
+    static bool passed(const timespec& t) {
+        timeval now;
+        gettimeofday(&now, NULL);
+        return now.tv_sec > t.tv_sec ||
+            (now.tv_sec == t.tv_sec && now.tv_usec * 1000ll >= t.tv_nsec);
+    }
+
+private:
+    const FlatForest& m_forest;
+    const uint m_maxBatch;
+    const uint m_maxLatency;
+    ThreadPool m_pool;
+    const uint m_numFeatures;
+    const uint m_maxClients;
+    const uint m_maxQueue;
+
+    /**
+     * Number of connected clients
+     */
+    uint m_numClients;
+
+    /**
+     * Set by stop()
+     */
+    bool m_stopping;
+
+    /**
+     * Protects the queue, the client count and the state of all connections
+     */
+    pthread_mutex_t m_mutex;
+
+    /**
+     * Signalled when requests are added to an empty queue, when a full
+     * batch is available, or when stopping
+     */
+    pthread_cond_t m_ready;
+
+    /**
+     * Signalled when requests are taken from the queue
+     */
+    pthread_cond_t m_space;
+
+    /**
+     * Requests waiting to be scored
+     */
+    std::deque<Request*> m_queue;
+};
+
+
+struct ClientArg
+{
+    BatchServer* server;
+    Connection* conn;
+};
+
+void* serveClient(void* arg)
+{
+    ClientArg* a = static_cast<ClientArg*>(arg);
+    a->server->serveConnection(a->conn);
+    close(a->conn->in);
+    delete a->conn;
+    a->server->leave();
+    delete a;
+    return NULL;
+}
+
+void* runBatches(void* arg)
+{
+    static_cast<BatchServer*>(arg)->run();
+    return NULL;
+}
+
+FlatForest* loadForest(const char fname[])
+{
+    std::ifstream is(fname, std::ios::binary);
+    if (!is) {
+        LOG(Log::ERROR) << "Unable to open " << fname;
+        return NULL;
+    }
+
+    char head[8];
+    is.read(head, sizeof(head));
+    if (FlatForest::isBinary(head, is.gcount())) {
+        is.close();
+        return FlatForest::map(fname);
+    }
+    is.clear();
+    is.seekg(0);
+
+    Deserialiser ds(is);
+    RFbuilder builder(ds);
+    RFforest::Ptr forest(builder.dRFforest());
+    if (!forest) {
+        return NULL;
+    }
+    return FlatForest::flatten(*forest);
+}
+
+int listenUnix(const char path[])
+{
+    sockaddr_un addr;
+    if (std::strlen(path) >= sizeof(addr.sun_path)) {
+        LOG(Log::ERROR) << "Socket path too long: " << path;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOG(Log::ERROR) << "socket: " << std::strerror(errno);
+        return -1;
+    }
+
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        LOG(Log::ERROR) << "Unable to listen on " << path << ": "
+                        << std::strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char* argv[])
+{
+    Log::reportingLevel() = Log::INFO;
+
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " model [socket|-] [max-batch]"
+                  << " [max-latency-us] [threads] [max-clients] [max-queue]"
+                  << std::endl;
+        return 1;
+    }
+
+    const char* socketPath = argc > 2? argv[2]: "-";
+    uint maxBatch = argc > 3? atoi(argv[3]): 256;
+    uint maxLatency = argc > 4? atoi(argv[4]): 1000;
+    uint numThreads = argc > 5? atoi(argv[5]): 0;
+    uint maxClients = argc > 6? atoi(argv[6]): 64;
+    uint maxQueue = argc > 7? atoi(argv[7]): 16 * maxBatch;
+
+    FlatForest* forest = loadForest(argv[1]);
+    if (!forest) {
+        return 1;
+    }
+    LOG(Log::INFO) << "Loaded " << forest->numTrees() << " trees, "
+                   << forest->numClasses() << " classes";
+
+    signal(SIGPIPE, SIG_IGN);
+    BatchServer server(*forest, std::max(maxBatch, 1u), maxLatency,
+                       numThreads, std::max(maxClients, 1u),
+                       std::max(maxQueue, 1u));
+
+    pthread_t batcher;
+    pthread_create(&batcher, NULL, runBatches, &server);
+
+    if (std::strcmp(socketPath, "-") == 0) {
+        // Returns once all replies have been written
+        Connection conn(STDIN_FILENO, STDOUT_FILENO);
+        server.serveConnection(&conn);
+        server.stop();
+        pthread_join(batcher, NULL);
+        delete forest;
+        return 0;
+    }
+
+    int fd = listenUnix(socketPath);
+    if (fd < 0) {
+        return 1;
+    }
+    LOG(Log::INFO) << "Listening on " << socketPath;
+
+    while (true) {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                LOG(Log::ERROR) << "accept: " << std::strerror(errno);
+            }
+            continue;
+        }
+
+        if (!server.admit()) {
+            LOG(Log::WARNING) << "Too many clients, refusing connection";
+            BatchServer::writeAll(client, "error: too many clients\n");
+            close(client);
+            continue;
+        }
+
+        ClientArg* arg = new ClientArg;
+        arg->server = &server;
+        arg->conn = new Connection(client, client);
+
+        pthread_t t;
+        pthread_create(&t, NULL, serveClient, arg);
+        pthread_detach(t);
+    }
+
+    return 0;
+}
@@ -1,12 +1,18 @@
 /**
  * Test program for the random forest
+ *
+ * Usage: rftest [-c columns] [dataset [trees [threads [output]]]]
+ * -c gives a comma separated list of the CSV columns holding categorical
+ * features, binary datasets store this themselves.
  */
 #include "DataIO.hpp"
 #include "Dataset.hpp"
+#include "MappedDataset.hpp"
 
 #include "RFparameters.hpp"
 #include "RFnode.hpp"
 #include "RFtree.hpp"
+#include "RFpredict.hpp"
 
 #include "RFserialise.hpp"
 #include "RFdeserialise.hpp"
@@ -16,8 +22,10 @@
 
 
 #include <iostream>
+#include <fstream>
 #include <ctime>
 #include <cmath>
+#include <cstring>
 
 #include <algorithm>
 #include <functional>
@@ -93,36 +101,47 @@ Dataset::Ptr createTestDataset(uint n, uint f)
 }
 
 
-Dataset::Ptr openTestDataset(const char fname[])
+bool isLibsvmFile(const char fname[])
 {
-    CsvReader csv;
-    bool status = csv.parse(fname);
-    if (!status) {
-        LOG(Log::ERROR) << "Error parsing " << fname;
-        exit(1);
-    }
+    const char* ext = std::strrchr(fname, '.');
+    return ext && (std::strcmp(ext, ".svm") == 0 ||
+                   std::strcmp(ext, ".libsvm") == 0);
+}
 
-    // Class label(ground truth) should be in the last column
-    SingleMatrixDataset* d = new SingleMatrixDataset(
-        csv.rows(), csv.cols() - 1);
-    Dataset::Ptr pd(d);
-    uint colLabel = csv.cols() - 1;
+Dataset::Ptr openTestDataset(const char fname[], uint nthreads = 0,
+                             const UintArray& categorical = UintArray())
+{
+    std::ifstream is(fname, std::ios::binary);
+    char magic[8] = {0};
+    is.read(magic, sizeof(magic));
+    is.close();
 
-    for (uint r = 0; r < csv.rows(); ++r)
+    Dataset::Ptr pd;
+    if (MappedDataset::isDataset(magic, is.gcount()))
     {
-        for (uint c = 0; c < csv.cols() - 1; ++c)
-        {
-            d->setX(r, c, csv(r, c));
-        }
-        d->setLabel(r, csv(r, colLabel));
+        // Binary dataset created by rfconvert -d
+        pd = MappedDataset::open(fname);
+    }
+    else if (isLibsvmFile(fname))
+    {
+        pd = LibsvmDatasetReader::read(fname);
+    }
+    else
+    {
+        // Class label(ground truth) should be in the last column
+        pd = CsvDatasetReader::read(fname, -1, nthreads, categorical);
+    }
+    if (!pd) {
+        LOG(Log::ERROR) << "Error parsing " << fname;
+        exit(1);
     }
 
-    for (uint c = 0; c < d->numFeatures(); ++c)
+    for (uint c = 0; c < pd->numFeatures(); ++c)
     {
         LOG(Log::DEBUG2) << "ft " << c << "\t"
-                         << arrayToString(*d->getFeature(c));
+                         << arrayToString(*pd->getFeature(c));
     }
-    LOG(Log::DEBUG2) << "ls " << arrayToString(*d->getLabels());
+    LOG(Log::DEBUG2) << "ls " << arrayToString(*pd->getLabels());
 
     return pd;
 }
@@ -260,7 +279,29 @@ RFforest::Ptr testForest(const Dataset::Ptr data, bool show, int NUMTREE)
     params->numSplitFeatures = std::ceil(std::sqrt(data->numFeatures()));
     params->minScore = 1e-6;
 
-    RFforest::Ptr forest = new RFforest(data.get(), params);
+    // Train on the concrete dataset type where possible, so feature values
+    // are read without virtual calls
+    RFforest::Ptr forest;
+    if (const SingleMatrixDataset* d =
+        dynamic_cast<const SingleMatrixDataset*>(data.get()))
+    {
+        forest = new RFforest(d, params);
+    }
+    else if (const MappedDataset* d =
+             dynamic_cast<const MappedDataset*>(data.get()))
+    {
+        forest = new RFforest(d, params);
+    }
+    else if (const SparseDataset* d =
+             dynamic_cast<const SparseDataset*>(data.get()))
+    {
+        forest = new RFforest(d, params);
+    }
+    else
+    {
+        forest = new RFforest(data.get(), params);
+    }
+    forest->orderTreesByOob();
 
     return forest;
 }
@@ -292,28 +333,59 @@ void printTimes(const ClockTimer& timer)
     cout << endl;
 }
 
-void predictClass(const Dataset::Ptr data, const RFforest::Ptr f)
+template <typename DatasetT>
+void predictClass(const DatasetT& data, const RFforest::Ptr f,
+                  uint numThreads)
 {
     char result_file[256] = "./predicted_result";
     FileLogger logger(result_file, 512*1024*1024ull, 4);
 
-    using std::cout;
-    using std::endl;
+    // Number of samples predicted before the results are written out
+    static const uint BlockSize = 64 * 1024;
 
     IdArray ids;
-    data->getIds(ids);
+    data.getIds(ids);
 
-    std::vector<DoubleArray> preds1(ids.size());
-    f->setDataset(data.get());
+    f->setDataset(&data);
+    BatchPredictor predictor(*f, numThreads);
+    LOG(Log::DEBUG1) << "Predicting with " << predictor.numThreads()
+                     << " threads";
 
-    int result;
-    double mx = -1;
+    LabelArray labels(BlockSize);
+
+    for (uint i = 0; i < ids.size(); i += BlockSize)
+    {
+        uint n = std::min<uint>(BlockSize, ids.size() - i);
+        predictor.predict(&labels[0], data, &ids[i], n);
+
+        for (uint j = 0; j < n; ++j)
+        {
+            logger.logResult(labels[j]);
+        }
+    }
+}
 
-    for (uint i = 0; i < ids.size(); ++i)
+void predictClass(const Dataset::Ptr data, const RFforest::Ptr f,
+                  uint numThreads)
+{
+    if (const SingleMatrixDataset* d =
+        dynamic_cast<const SingleMatrixDataset*>(data.get()))
+    {
+        predictClass(*d, f, numThreads);
+    }
+    else if (const MappedDataset* d =
+             dynamic_cast<const MappedDataset*>(data.get()))
+    {
+        predictClass(*d, f, numThreads);
+    }
+    else if (const SparseDataset* d =
+             dynamic_cast<const SparseDataset*>(data.get()))
     {
-        f->predict(preds1[i], *data->getSample(ids[i]));
-        //cout << getClass_MaxProb(preds1[i]) << "\n";
-        logger.logResult(getClass_MaxProb(preds1[i]));
+        predictClass(*d, f, numThreads);
+    }
+    else
+    {
+        predictClass(*data, f, numThreads);
     }
 }
 
@@ -332,9 +404,20 @@ int main(int argc, char* argv[])
 
     timer.time("Getting dataset");
 
+    UintArray categorical;
+    if (argc > 2 && std::strcmp(argv[1], "-c") == 0)
+    {
+        if (!CsvDatasetReader::parseColumns(argv[2], categorical))
+        {
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     int numTree = 10;
     if (argc > 1)
-        ds = openTestDataset(argv[1]);
+        ds = openTestDataset(argv[1], 0, categorical);
     else
     {
         //ds = openTestDataset("../data/ionosphere.csv");
@@ -348,11 +431,26 @@ int main(int argc, char* argv[])
         printf("n trees: %d\n", numTree);
     }
 
+    // 0: use all processors
+    uint numThreads = 0;
+    if(argc > 3)
+    {
+        numThreads = atoi(argv[3]);
+        printf("n threads: %d\n", numThreads);
+    }
+
     timer.time("Creating forest");
     f = testForest(ds, false, numTree);
 
+    if(argc > 4)
+    {
+        timer.time("Saving forest");
+        std::ofstream os(argv[4]);
+        f->serialiseIndexed(os, 0, true, numThreads);
+    }
+
     timer.time("Prediction");
-    predictClass(ds, f);
+    predictClass(ds, f, numThreads);
 
     timer.time("Finished");
     printTimes(timer);
@@ -0,0 +1,589 @@
+/**
+ * Unit tests for the model formats, the block codec, the dataset parsers and
+ * prediction
+ *
+ * Usage: rfunittest [datadir [tmpdir]]
+ * datadir holds iris.csv, temporary files are written to tmpdir and removed
+ * afterwards. Each failed check is printed, the exit status is 1 if any
+ * failed.
+ */
+#include "DataIO.hpp"
+#include "Dataset.hpp"
+#include "MappedDataset.hpp"
+
+#include "RFparameters.hpp"
+#include "RFtree.hpp"
+#include "RFpredict.hpp"
+#include "RFbinary.hpp"
+#include "BlockCodec.hpp"
+
+#include "RFserialise.hpp"
+#include "RFdeserialise.hpp"
+
+#include "Logger.hpp"
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "FileLogger.h"
+
+uint failures = 0;
+std::string tmpDir = ".";
+std::vector<std::string> tmpFiles;
+
+bool check(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cout << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+    return ok;
+}
+
+/**
+ * Return the path of a temporary file, which is removed at exit
+ */
+std::string tmpFile(const std::string& name)
+{
+    std::string path = tmpDir + "/rfunittest-" + name;
+    tmpFiles.push_back(path);
+    return path;
+}
+
+std::string writeFile(const std::string& name, const std::string& contents)
+{
+    std::string path = tmpFile(name);
+    std::ofstream os(path.c_str(), std::ios::binary);
+    os << contents;
+    return path;
+}
+
+/**
+ * Predict the class distributions of every sample
+ * ForestT: RFforest or FlatForest
+ */
+template <typename ForestT, typename DatasetT>
+void predictAll(std::vector<DoubleArray>& dists, const ForestT& f,
+                const DatasetT& data)
+{
+    FtvalArray row;
+    dists.assign(data.numSamples(), DoubleArray(f.numClasses()));
+    for (uint i = 0; i < data.numSamples(); ++i)
+    {
+        f.predict(&dists[i][0], DatasetAccess<DatasetT>::sample(data, i, row));
+    }
+}
+
+double maxDiff(const std::vector<DoubleArray>& a,
+               const std::vector<DoubleArray>& b)
+{
+    if (a.size() != b.size())
+    {
+        return HUGE_VAL;
+    }
+    double d = 0;
+    for (uint i = 0; i < a.size(); ++i)
+    {
+        if (a[i].size() != b[i].size())
+        {
+            return HUGE_VAL;
+        }
+        for (uint c = 0; c < a[i].size(); ++c)
+        {
+            d = std::max(d, std::fabs(a[i][c] - b[i][c]));
+        }
+    }
+    return d;
+}
+
+RFforest::Ptr trainForest(const SingleMatrixDataset& data, uint ntrees)
+{
+    RFparameters::Ptr params = new RFparameters;
+    params->numTrees = ntrees;
+    params->numSplitFeatures = std::ceil(std::sqrt(data.numFeatures()));
+    params->minScore = 1e-6;
+
+    Utils::srand(25);
+    RFforest::Ptr forest = new RFforest(&data, params);
+    forest->orderTreesByOob();
+    return forest;
+}
+
+/**
+ * Convert a binary model to a forest, as rfconvert does
+ */
+RFforest::Ptr binaryToForest(const FlatForest& flat)
+{
+    std::istringstream empty;
+    Deserialiser ds(empty);
+    RFbuilder builder(ds);
+    return builder.dRFforest(flat);
+}
+
+std::string binaryModel(const RFforest& forest, bool compress)
+{
+    FlatForest::Ptr flat = FlatForest::flatten(forest);
+    if (!check(flat, "flatten"))
+    {
+        return std::string();
+    }
+    std::ostringstream oss;
+    flat->write(oss, compress);
+    return oss.str();
+}
+
+FlatForest::Ptr openBinaryModel(const std::string& model)
+{
+    std::istringstream is(model);
+    return FlatForest::read(is);
+}
+
+bool testTextRoundTrip(const SingleMatrixDataset& data,
+                       const RFforest& forest)
+{
+    std::vector<DoubleArray> expected, dists;
+    predictAll(expected, forest, data);
+
+    std::string indexed = tmpFile("indexed.txt");
+    {
+        std::ofstream os(indexed.c_str());
+        forest.serialiseIndexed(os, 0, true, 2);
+    }
+    std::string plain = tmpFile("plain.txt");
+    {
+        std::ofstream os(plain.c_str());
+        forest.serialise(os, 0, 0);
+    }
+
+    const std::string* files[] = {&indexed, &plain};
+    for (uint k = 0; k < 2; ++k)
+    {
+        const std::string& name = *files[k];
+        RFforest::Ptr f = RFbuilder::openForest(name.c_str());
+        if (!check(f, "open " + name))
+        {
+            continue;
+        }
+        check(f->numTrees() == forest.numTrees(), "trees in " + name);
+        predictAll(dists, *f, data);
+        check(maxDiff(expected, dists) == 0, "predictions from " + name);
+
+        // The text model keeps the OOB order, so early stopping evaluates
+        // the same trees
+        bool same = true;
+        FtvalArray row;
+        DoubleArray d1, d2;
+        for (uint i = 0; i < data.numSamples(); ++i)
+        {
+            uint u1, u2;
+            DatasetAccess<SingleMatrixDataset>::Sample s =
+                DatasetAccess<SingleMatrixDataset>::sample(data, i, row);
+            same = same && forest.predictEarly(d1, s, &u1) ==
+                f->predictEarly(d2, s, &u2) && u1 == u2;
+        }
+        check(same, "early stopping with " + name);
+
+        check(binaryModel(*f, false) == binaryModel(forest, false),
+              "binary model from " + name);
+    }
+
+    return true;
+}
+
+bool testBinaryRoundTrip(const SingleMatrixDataset& data,
+                         const RFforest& forest)
+{
+    std::vector<DoubleArray> expected, dists;
+    predictAll(expected, forest, data);
+
+    for (uint compress = 0; compress < 2; ++compress)
+    {
+        std::string what = compress? "compressed ": "uncompressed ";
+        std::string model = binaryModel(forest, compress);
+        std::string file = writeFile(compress? "z.bin": "u.bin", model);
+
+        FlatForest::Ptr flat = FlatForest::map(file.c_str());
+        if (!check(flat, what + "binary model open"))
+        {
+            continue;
+        }
+        check(flat->numTrees() == forest.numTrees() &&
+              flat->numClasses() == forest.numClasses(),
+              what + "binary model header");
+
+        // Leaf distributions are quantised to 16 bits
+        predictAll(dists, *flat, data);
+        check(maxDiff(expected, dists) < 1e-4,
+              what + "binary model predictions");
+
+        // Binary to text and back gives the same binary model
+        RFforest::Ptr text = binaryToForest(*flat);
+        std::string textFile = tmpFile(compress? "z.txt": "u.txt");
+        {
+            std::ofstream os(textFile.c_str());
+            text->serialiseIndexed(os, 0, true, 1);
+        }
+        RFforest::Ptr reopened = RFbuilder::openForest(textFile.c_str());
+        if (!check(reopened, what + "text model from binary open"))
+        {
+            continue;
+        }
+        std::vector<DoubleArray> textDists;
+        predictAll(textDists, *reopened, data);
+        check(maxDiff(dists, textDists) < 1e-12,
+              what + "text model from binary predictions");
+        check(binaryModel(*reopened, compress) == model,
+              what + "text to binary round trip");
+    }
+
+    return true;
+}
+
+bool testBlockCodec()
+{
+    std::vector<std::string> inputs;
+    inputs.push_back("");
+    inputs.push_back("a");
+    inputs.push_back("abcd");
+    inputs.push_back(std::string(100000, '\0'));
+
+    std::string s;
+    for (uint i = 0; i < 1000; ++i)
+    {
+        s += "abcabcabd"[Utils::randint(0, 9)];
+    }
+    inputs.push_back(s);
+
+    s.clear();
+    for (uint i = 0; i < 5000; ++i)
+    {
+        s += char(Utils::randint(0, 256));
+    }
+    inputs.push_back(s);
+
+    for (uint i = 0; i < inputs.size(); ++i)
+    {
+        const std::string& in = inputs[i];
+        std::ostringstream what;
+        what << "block codec input " << i;
+
+        std::string packed;
+        BlockCodec::compress(in.data(), in.size(), packed);
+        std::vector<char> out(in.size() + 1);
+        check(BlockCodec::decompress(packed.data(), packed.size(), &out[0],
+                                     in.size()) &&
+              std::string(&out[0], in.size()) == in, what.str());
+
+        // A truncated block or the wrong size is detected
+        if (!in.empty())
+        {
+            check(!BlockCodec::decompress(packed.data(), packed.size() - 1,
+                                          &out[0], in.size()),
+                  what.str() + " truncated");
+            check(!BlockCodec::decompress(packed.data(), packed.size(),
+                                          &out[0], in.size() - 1),
+                  what.str() + " too long");
+        }
+        check(!BlockCodec::decompress(packed.data(), packed.size(), &out[0],
+                                      in.size() + 1),
+              what.str() + " too short");
+
+        // Corrupt data must never write outside the buffer, whether or not
+        // it's detected
+        for (uint k = 0; k < 100 && !packed.empty(); ++k)
+        {
+            std::string bad = packed;
+            bad[Utils::randint(0, bad.size())] ^=
+                char(1 << Utils::randint(0, 8));
+            BlockCodec::decompress(bad.data(), bad.size(), &out[0],
+                                   in.size());
+        }
+
+        std::vector<char> shuffled(in.size() + 1), unshuffled(in.size() + 1);
+        BlockCodec::shuffle(in.data(), &shuffled[0], in.size() / 4, 4);
+        BlockCodec::unshuffle(&shuffled[0], &unshuffled[0], in.size() / 4, 4);
+        check(std::string(&unshuffled[0], in.size() / 4 * 4) ==
+              in.substr(0, in.size() / 4 * 4), what.str() + " shuffle");
+    }
+
+    // A match before the start of the output, and a zero offset
+    static const char before[] = {0x10, 'a', 0x02, 0x00};
+    static const char zero[] = {0x10, 'a', 0x00, 0x00};
+    char out[8];
+    check(!BlockCodec::decompress(before, sizeof(before), out, 5),
+          "block codec offset before start");
+    check(!BlockCodec::decompress(zero, sizeof(zero), out, 5),
+          "block codec zero offset");
+
+    return true;
+}
+
+/**
+ * Read a little endian integer from a binary model
+ */
+size_t readLe(const std::string& model, size_t pos, uint bytes)
+{
+    size_t x = 0;
+    for (uint i = 0; i < bytes && pos + i < model.size(); ++i)
+    {
+        x |= size_t((unsigned char)model[pos + i]) << (8 * i);
+    }
+    return x;
+}
+
+bool testCorruptBinaryModel(const RFforest& forest)
+{
+    std::string model = binaryModel(forest, true);
+    check(openBinaryModel(model), "compressed binary model");
+
+    // The offset and size of the first and last trees from the tree index
+    size_t indexOffset = readLe(model, 56, 8);
+    size_t lastEntry = indexOffset +
+        (forest.numTrees() - 1) * FlatForest::IndexEntrySize;
+    size_t first = readLe(model, indexOffset, 8);
+    size_t firstBytes = readLe(model, indexOffset + 8, 8);
+    size_t last = readLe(model, lastEntry, 8);
+    size_t lastBytes = readLe(model, lastEntry + 8, 8);
+    if (!check(first + firstBytes <= model.size() &&
+               last + lastBytes <= model.size(), "binary model tree index"))
+    {
+        return false;
+    }
+
+    check(!openBinaryModel(model.substr(0, last + lastBytes - 1)),
+          "truncated binary model");
+    check(!openBinaryModel(model.substr(0, 32)), "binary model header");
+
+    std::string bad = model;
+    bad[0] = 'X';
+    check(!openBinaryModel(bad), "binary model magic");
+
+    bad = model;
+    std::fill(bad.begin() + first, bad.begin() + first + firstBytes, 0);
+    check(!openBinaryModel(bad), "corrupt compressed tree");
+
+    return true;
+}
+
+bool testCsvParser()
+{
+    static const char* bad[] = {
+        "1.5abc,2,0\n1,2,1\n",
+        "1.5,2x,0\n",
+        "1,2,0\n1,2\n",
+        "1,2,0\n1,2,0,1\n",
+        "a,b,label\n1,2,0\n",
+        "1,2,0\n3,4,1e\n",
+        "",
+    };
+    for (uint i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        std::string f = writeFile("bad.csv", bad[i]);
+        check(!CsvDatasetReader::read(f.c_str()),
+              std::string("CSV rejected: ") + bad[i]);
+    }
+
+    // Blanks around numbers, and no newline at the end
+    std::string f = writeFile("good.csv", "1.5 ,2\t,0\n 3,-4e1,1");
+    Dataset::Ptr d = CsvDatasetReader::read(f.c_str());
+    if (check(d, "CSV accepted"))
+    {
+        const SingleMatrixDataset* m =
+            dynamic_cast<const SingleMatrixDataset*>(d.get());
+        check(m && m->numSamples() == 2 && m->numFeatures() == 2 &&
+              m->getX(0, 0) == 1.5 && m->getX(1, 1) == -40 &&
+              m->getLabel(1) == 1, "CSV values");
+    }
+
+    return true;
+}
+
+bool testLibsvmParser()
+{
+    static const char* bad[] = {
+        "1 1:x\n",
+        "1 a:1\n",
+        "1 2:1 1:3\n",
+        "1 1:2 1:3\n",
+        "1 0:1\n",
+        "-1 1:2\n",
+        "1.5 1:2\n",
+        "1 1:2x\n",
+        "0 1:1\n1 2:\n",
+    };
+    for (uint i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+    {
+        std::string f = writeFile("bad.svm", bad[i]);
+        check(!LibsvmDatasetReader::read(f.c_str()),
+              std::string("libsvm rejected: ") + bad[i]);
+    }
+
+    // Blank lines are skipped, zeros aren't stored
+    std::string f = writeFile("good.svm", "0 1:0.5 3:2\n\n1 2:1 3:0\n2");
+    Dataset::Ptr d = LibsvmDatasetReader::read(f.c_str());
+    if (check(d, "libsvm accepted"))
+    {
+        const SparseDataset* s = dynamic_cast<const SparseDataset*>(d.get());
+        check(s && s->numSamples() == 3 && s->numFeatures() == 3 &&
+              s->numNonzeros() == 3 && s->getX(0, 0) == 0.5 &&
+              s->getX(0, 2) == 2 && s->getX(1, 1) == 1 &&
+              s->getX(1, 2) == 0 && s->getLabel(2) == 2 &&
+              s->numClasses() == 3, "libsvm values");
+    }
+
+    return true;
+}
+
+bool testMappedDataset(const SingleMatrixDataset& data)
+{
+    std::ostringstream oss;
+    check(MappedDataset::write(oss, data), "write binary dataset");
+    std::string file = oss.str();
+
+    std::string f = writeFile("data.bin", file);
+    MappedDataset* m = MappedDataset::open(f.c_str());
+    if (check(m, "open binary dataset"))
+    {
+        bool same = m->numSamples() == data.numSamples() &&
+            m->numFeatures() == data.numFeatures() &&
+            m->numClasses() == data.numClasses();
+        for (uint r = 0; same && r < data.numSamples(); ++r)
+        {
+            same = m->getLabel(r) == data.getLabel(r);
+            for (uint c = 0; same && c < data.numFeatures(); ++c)
+            {
+                same = m->column(c)[r] == data.getX(r, c);
+            }
+        }
+        check(same, "binary dataset values");
+        delete m;
+    }
+
+    std::vector<std::string> bad;
+    bad.push_back("");
+    bad.push_back(file.substr(0, MappedDataset::HeaderSize));
+    bad.push_back(file.substr(0, file.size() - 1));
+    bad.push_back(file);
+    bad.back()[0] = 'X';
+    bad.push_back(file);
+    bad.back()[8] = 9;
+    for (uint i = 0; i < bad.size(); ++i)
+    {
+        std::ostringstream what;
+        what << "binary dataset rejected " << i;
+        f = writeFile("bad.bin", bad[i]);
+        m = MappedDataset::open(f.c_str());
+        check(!m, what.str());
+        delete m;
+    }
+    check(!MappedDataset::open(tmpFile("missing.bin").c_str()),
+          "missing binary dataset");
+
+    return true;
+}
+
+bool testPrediction(const SingleMatrixDataset& data, const RFforest& forest)
+{
+    typedef DatasetAccess<SingleMatrixDataset> Access;
+
+    uint n = data.numSamples();
+    LabelArray expected(n);
+    std::vector<DoubleArray> dists;
+    predictAll(dists, forest, data);
+    for (uint i = 0; i < n; ++i)
+    {
+        expected[i] = getClass_MaxProb(dists[i]);
+    }
+
+    // Early stopping gives the same class as the full prediction
+    FtvalArray row;
+    DoubleArray dist;
+    bool same = true;
+    bool fewer = false;
+    for (uint i = 0; i < n; ++i)
+    {
+        uint used;
+        same = same && forest.predictEarly(
+            dist, Access::sample(data, i, row), &used) == expected[i];
+        fewer = fewer || used < forest.numTrees();
+    }
+    check(same, "early stopping predictions");
+    check(fewer, "early stopping evaluates fewer trees");
+
+    IdArray ids;
+    data.getIds(ids);
+    for (uint nthreads = 1; nthreads <= 3; nthreads += 2)
+    {
+        BatchPredictor predictor(forest, nthreads, 7);
+        LabelArray labels(n);
+        predictor.predict(&labels[0], data, &ids[0], n);
+        check(labels == expected, "batch predictions");
+
+        // Through the Dataset interface
+        predictor.predict(&labels[0], static_cast<const Dataset&>(data),
+                          &ids[0], n);
+        check(labels == expected, "batch predictions of a Dataset");
+    }
+
+    // Sparse samples are predicted the same as dense ones
+    SparseDataset sparse(data);
+    std::vector<DoubleArray> sparseDists;
+    predictAll(sparseDists, forest, sparse);
+    check(maxDiff(dists, sparseDists) == 0, "sparse predictions");
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Log::reportingLevel() = Log::WARNING;
+
+    std::string dataDir = argc > 1? argv[1]: "../data";
+    if (argc > 2)
+    {
+        tmpDir = argv[2];
+    }
+
+    Utils::srand(25);
+    Dataset::Ptr ds = CsvDatasetReader::read((dataDir + "/iris.csv").c_str());
+    const SingleMatrixDataset* data =
+        dynamic_cast<const SingleMatrixDataset*>(ds.get());
+    if (!data)
+    {
+        std::cout << "Unable to read " << dataDir << "/iris.csv" << std::endl;
+        return 1;
+    }
+    RFforest::Ptr forest = trainForest(*data, 30);
+
+    testTextRoundTrip(*data, *forest);
+    testBinaryRoundTrip(*data, *forest);
+    testBlockCodec();
+    testCorruptBinaryModel(*forest);
+    testCsvParser();
+    testLibsvmParser();
+    testMappedDataset(*data);
+    testPrediction(*data, *forest);
+
+    for (uint i = 0; i < tmpFiles.size(); ++i)
+    {
+        std::remove(tmpFiles[i].c_str());
+    }
+
+    if (failures > 0)
+    {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}